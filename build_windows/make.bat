@@ -17,7 +17,19 @@ if "%DATETIMEVERSION%" == " " (
 
 cl /c /O2 /GL /GS- /W4 /EHsc ../src/soque.cpp
 cl /c /O2 /GL /GS- /W4 /EHsc /I../src ../examples/soque_test.c
+cl /c /O2 /GL /GS- /W4 /EHsc /I../src ../examples/soque_micro.c
+cl /c /O2 /GL /GS- /W4 /EHsc /I../src ../examples/soque_bench.c
+cl /c /O2 /GL /GS- /W4 /EHsc /I../src ../examples/soque_order.c
+cl /c /O2 /GL /GS- /W4 /EHsc /I../src ../examples/soque_graph.c
+cl /c /O2 /GL /GS- /W4 /EHsc /I../src ../examples/soque_place.c
+cl /c /O2 /GL /GS- /W4 /EHsc /I../src ../examples/soque_inline.cpp
 rc -r soque.rc
 
 link /DLL /LTCG soque.obj soque.res /OUT:%OUT%.dll
 link /LTCG soque_test.obj soque.res %OUT%.lib /subsystem:console /OUT:%OUT%_test.exe
+link /LTCG soque_micro.obj soque.res %OUT%.lib /subsystem:console /OUT:%OUT%_micro.exe
+link /LTCG soque_bench.obj soque.res %OUT%.lib /subsystem:console /OUT:%OUT%_bench.exe
+link /LTCG soque_order.obj soque.res %OUT%.lib /subsystem:console /OUT:%OUT%_order.exe
+link /LTCG soque_graph.obj soque.res %OUT%.lib /subsystem:console /OUT:%OUT%_graph.exe
+link /LTCG soque_place.obj soque.res %OUT%.lib /subsystem:console /OUT:%OUT%_place.exe
+link /LTCG soque_inline.obj soque.res /subsystem:console /OUT:%OUT%_inline.exe
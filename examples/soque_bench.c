@@ -0,0 +1,430 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#define THREAD_LOCAL __declspec( thread )
+#else
+#include <stdlib.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <sys/resource.h>
+#define THREAD_LOCAL __thread
+#endif
+
+#define SOQUE_WITH_LOADER
+#include "soque.h"
+
+#ifdef _WIN32
+#define rdtsc() __rdtsc()
+#else
+#define rdtsc() __builtin_ia32_rdtsc()
+#endif
+
+// end-to-end sweep: every combination of the lists runs warmup + duration seconds,
+// one JSON result per line so a baseline can be matched line by line,
+// exit code 2 when a case lost more than tolerance % against the baseline
+
+#define MAX_LIST 16
+
+typedef struct
+{
+    uint32_t values[MAX_LIST];
+    uint32_t count;
+} LIST;
+
+#define SKEW_UNIFORM 0 // every slot costs proctsc
+#define SKEW_EXP 1 // exponential, mean proctsc
+#define SKEW_PARETO 2 // pareto alpha 1.5, mean proctsc, heavy tail
+#define SKEW_BIMODAL 3 // 1 slot in 100 costs 50x, mean ~ proctsc
+
+static const char * skew_names[] = { "uniform", "exp", "pareto", "bimodal" };
+
+static volatile long long g_proc_count;
+static unsigned long long g_proctsc;
+static unsigned g_skew;
+static THREAD_LOCAL uint64_t g_rng;
+
+static double rand01()
+{
+    if( g_rng == 0 )
+        g_rng = rdtsc() | 1;
+
+    g_rng ^= g_rng << 13;
+    g_rng ^= g_rng >> 7;
+    g_rng ^= g_rng << 17;
+
+    return ( ( g_rng >> 11 ) + 0.5 ) / 9007199254740992.0; // ( 0, 1 )
+}
+
+static unsigned long long slot_cost()
+{
+    switch( g_skew )
+    {
+        case SKEW_EXP:
+            return (unsigned long long)( -log( rand01() ) * g_proctsc );
+        case SKEW_PARETO:
+            return (unsigned long long)( g_proctsc / 3.0 / pow( rand01(), 1 / 1.5 ) );
+        case SKEW_BIMODAL:
+            return rand01() < 0.01 ? g_proctsc * 50 : g_proctsc / 2;
+        default:
+            return g_proctsc;
+    }
+}
+
+static void busy( unsigned long long h )
+{
+    unsigned long long c = rdtsc();
+    while( rdtsc() - c < h ){}
+}
+
+static uint32_t SOQUE_CALL bench_io_cb( void * arg, uint32_t batch, uint8_t waitable )
+{
+    (void)arg;
+    (void)waitable;
+
+    if( g_proctsc )
+        busy( g_proctsc * batch / 16 );
+
+    return batch;
+}
+
+static void SOQUE_CALL bench_proc_cb( void * arg, SOQUE_BATCH proc_batch )
+{
+    unsigned long long h = 0;
+    uint32_t i;
+
+    (void)arg;
+
+#ifdef _WIN32
+    InterlockedExchangeAdd64( &g_proc_count, proc_batch.count );
+#else
+    __sync_fetch_and_add( &g_proc_count, proc_batch.count );
+#endif
+
+    if( g_proctsc )
+    {
+        for( i = 0; i < proc_batch.count; i++ )
+            h += slot_cost();
+
+        busy( h );
+    }
+}
+
+static double wall_sec()
+{
+#ifdef _WIN32
+    LARGE_INTEGER f, c;
+    QueryPerformanceFrequency( &f );
+    QueryPerformanceCounter( &c );
+    return (double)c.QuadPart / f.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static double cpu_sec()
+{
+#ifdef _WIN32
+    FILETIME c, e, k, u;
+    GetProcessTimes( GetCurrentProcess(), &c, &e, &k, &u );
+    return ( ( (unsigned long long)k.dwHighDateTime << 32 | k.dwLowDateTime ) + ( (unsigned long long)u.dwHighDateTime << 32 | u.dwLowDateTime ) ) / 1e7;
+#else
+    struct rusage ru;
+    getrusage( RUSAGE_SELF, &ru );
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+#endif
+}
+
+static void sleep_sec( double s )
+{
+#ifdef _WIN32
+    Sleep( (DWORD)( s * 1000 ) );
+#else
+    usleep( (useconds_t)( s * 1000000 ) );
+#endif
+}
+
+static void parse_list( LIST * list, const char * text )
+{
+    list->count = 0;
+
+    while( *text && list->count < MAX_LIST )
+    {
+        list->values[list->count++] = (uint32_t)strtoul( text, (char **)&text, 10 );
+
+        if( *text == ',' )
+            text++;
+        else
+            break;
+    }
+}
+
+static uint32_t parse_skew( const char * text )
+{
+    uint32_t i;
+
+    for( i = 0; i < sizeof( skew_names ) / sizeof( skew_names[0] ); i++ )
+        if( strcmp( text, skew_names[i] ) == 0 )
+            return i;
+
+    return SKEW_UNIFORM;
+}
+
+// percentile of a latency histogram in tsc, 0 if empty
+static uint64_t percentile( const uint64_t * buckets, double p )
+{
+    unsigned long long total = 0;
+    unsigned long long seen = 0;
+    uint32_t b;
+
+    for( b = 0; b < SOQUE_LATENCY_BUCKETS; b++ )
+        total += buckets[b];
+
+    for( b = 0; b < SOQUE_LATENCY_BUCKETS && total; b++ )
+    {
+        seen += buckets[b];
+
+        if( seen >= total * p )
+            return soque_latency_floor( b );
+    }
+
+    return 0;
+}
+
+// "mpps": of the baseline line with the same "case":, < 0 if none;
+// the case name carries every parameter the run was made with, so only like runs compare
+static double baseline_mpps( FILE * baseline, const char * name )
+{
+    char line[1024];
+    char key[160];
+    const char * m;
+
+    if( !baseline )
+        return -1;
+
+    snprintf( key, sizeof( key ), "\"case\": \"%s\"", name );
+    rewind( baseline );
+
+    while( fgets( line, sizeof( line ), baseline ) )
+    {
+        if( !strstr( line, key ) || !( m = strstr( line, "\"mpps\": " ) ) )
+            continue;
+
+        return atof( m + 8 );
+    }
+
+    return -1;
+}
+
+int main( int argc, char ** argv )
+{
+    LIST sizes = { { 1024 }, 1 };
+    LIST counts = { { 2 }, 1 };
+    LIST threads = { { 2 }, 1 };
+    LIST batches = { { 16 }, 1 };
+    LIST proctscs = { { 1000 }, 1 };
+    uint32_t skew = SKEW_UNIFORM;
+    uint32_t flags = 0;
+    uint32_t bind = 0;
+    uint32_t utilization = 0;
+    uint32_t size_max = 0;
+    double warmup = 1;
+    double duration = 3;
+    double tolerance = 5;
+    const char * out_name = "soque_bench.json";
+    FILE * out;
+    FILE * baseline = NULL;
+    static uint64_t latency[SOQUE_LATENCY_BUCKETS];
+    static uint64_t latency_sum[SOQUE_LATENCY_BUCKETS];
+    uint32_t regressions = 0;
+    uint32_t first = 1;
+    uint32_t s, c, t, b, p, i, k;
+
+    for( i = 1; i < (uint32_t)argc; i++ )
+    {
+        char * v = strchr( argv[i], '=' );
+
+        if( !v )
+        {
+            printf( "usage: soque_bench [sizes=1024,4096] [queues=1,2] [threads=1,2,4] [batches=16,64] [proctsc=0,1000]\n"
+                    "                   [skew=uniform|exp|pareto|bimodal] [flags=0] [bind=0] [utilization=0] [size_max=0] [warmup=1]\n"
+                    "                   [duration=3] [out=soque_bench.json] [baseline=old.json] [tolerance=5]\n" );
+            return 1;
+        }
+
+        *v++ = 0;
+
+        if( strcmp( argv[i], "sizes" ) == 0 )
+            parse_list( &sizes, v );
+        else if( strcmp( argv[i], "queues" ) == 0 )
+            parse_list( &counts, v );
+        else if( strcmp( argv[i], "threads" ) == 0 )
+            parse_list( &threads, v );
+        else if( strcmp( argv[i], "batches" ) == 0 )
+            parse_list( &batches, v );
+        else if( strcmp( argv[i], "proctsc" ) == 0 )
+            parse_list( &proctscs, v );
+        else if( strcmp( argv[i], "skew" ) == 0 )
+            skew = parse_skew( v );
+        else if( strcmp( argv[i], "flags" ) == 0 )
+            flags = atoi( v );
+        else if( strcmp( argv[i], "bind" ) == 0 )
+            bind = atoi( v );
+        else if( strcmp( argv[i], "utilization" ) == 0 )
+            utilization = atoi( v );
+        else if( strcmp( argv[i], "size_max" ) == 0 )
+            size_max = atoi( v );
+        else if( strcmp( argv[i], "warmup" ) == 0 )
+            warmup = atof( v );
+        else if( strcmp( argv[i], "duration" ) == 0 )
+            duration = atof( v );
+        else if( strcmp( argv[i], "tolerance" ) == 0 )
+            tolerance = atof( v );
+        else if( strcmp( argv[i], "out" ) == 0 )
+            out_name = v;
+        else if( strcmp( argv[i], "baseline" ) == 0 && !( baseline = fopen( v, "r" ) ) )
+        {
+            printf( "ERROR: can not read \"%s\"\n", v );
+            return 1;
+        }
+    }
+
+    out = fopen( out_name, "w" );
+
+    if( !out )
+    {
+        printf( "ERROR: can not write \"%s\"\n", out_name );
+        return 1;
+    }
+
+    if( !soque_load() )
+        return 1;
+
+    g_skew = skew;
+
+    fprintf( out, "{ \"soque\": \"%d.%d\", \"skew\": \"%s\", \"flags\": %u, \"bind\": %u, \"warmup\": %.1f, \"duration\": %.1f, \"results\": [\n",
+             soq->soque_major, soq->soque_minor, skew_names[skew], flags, bind, warmup, duration );
+
+    for( s = 0; s < sizes.count; s++ )
+    for( c = 0; c < counts.count; c++ )
+    for( t = 0; t < threads.count; t++ )
+    for( b = 0; b < batches.count; b++ )
+    for( p = 0; p < proctscs.count; p++ )
+    {
+        SOQUE_HANDLE q[64];
+        SOQUE_THREADS_HANDLE qt;
+        uint32_t count = counts.values[c] < 64 ? counts.values[c] : 64;
+        long long proc_start;
+        double wall_start, cpu_start, wall, cpu, mpps, base;
+        unsigned long long tsc_start;
+        double tsc_per_ns;
+        uint32_t has_latency = 0;
+        char name[128];
+
+        snprintf( name, sizeof( name ), "s%u-q%u-t%u-b%u-p%u-%s-f%u-n%u-u%u-m%u", sizes.values[s], count, threads.values[t], batches.values[b], proctscs.values[p], skew_names[skew],
+                  flags, bind, utilization, size_max );
+        g_proctsc = proctscs.values[p];
+
+        for( i = 0; i < count; i++ )
+        {
+            q[i] = soq->soque_open_ex( sizes.values[s], flags, NULL, bench_io_cb, bench_proc_cb, bench_io_cb );
+
+            if( !q[i] )
+            {
+                printf( "ERROR: soque_open = NULL\n" );
+                return 1;
+            }
+        }
+
+        qt = soq->soque_threads_open( threads.values[t], (uint8_t)bind, q, count );
+        soq->soque_threads_tune( qt, batches.values[b], 10000, 100 );
+
+        if( utilization )
+            soq->soque_threads_scale( qt, utilization, 0, 0 );
+
+        // rings start at the case size and grow by occupancy
+        if( size_max )
+            soq->soque_threads_resize( qt, sizes.values[s], size_max );
+
+        if( batches.values[b] == 0 )
+            soq->soque_threads_batch( qt, 1, 1024, 100 );
+
+        sleep_sec( warmup );
+
+        for( i = 0; i < count; i++ )
+            soq->soque_latency( q[i], SOQUE_LATENCY_TOTAL, NULL, 1 );
+
+        proc_start = g_proc_count;
+        wall_start = wall_sec();
+        cpu_start = cpu_sec();
+        tsc_start = rdtsc();
+
+        sleep_sec( duration );
+
+        wall = wall_sec() - wall_start;
+        cpu = cpu_sec() - cpu_start;
+        tsc_per_ns = ( rdtsc() - tsc_start ) / ( wall * 1e9 );
+        mpps = ( g_proc_count - proc_start ) / wall / 1e6;
+
+        memset( latency_sum, 0, sizeof( latency_sum ) );
+
+        for( i = 0; i < count; i++ )
+        {
+            if( soq->soque_latency( q[i], SOQUE_LATENCY_TOTAL, latency, 0 ) )
+            {
+                has_latency = 1;
+
+                for( k = 0; k < SOQUE_LATENCY_BUCKETS; k++ )
+                    latency_sum[k] += latency[k];
+            }
+        }
+
+        soq->soque_threads_close( qt );
+
+        for( i = 0; i < count; i++ )
+            soq->soque_close( q[i] );
+
+        fprintf( out, "%s  { \"case\": \"%s\", \"queue_size\": %u, \"queue_count\": %u, \"threads\": %u, \"batch\": %u, \"proctsc\": %u, \"flags\": %u, \"bind\": %u, \"utilization\": %u, \"size_max\": %u, \"mpps\": %.4f, \"cpu\": %.2f",
+                 first ? "" : ",\n", name, sizes.values[s], count, threads.values[t], batches.values[b], proctscs.values[p], flags, bind, utilization, size_max, mpps, cpu / wall );
+
+        if( has_latency )
+            fprintf( out, ", \"p50_ns\": %.0f, \"p99_ns\": %.0f, \"p999_ns\": %.0f",
+                     percentile( latency_sum, 0.5 ) / tsc_per_ns, percentile( latency_sum, 0.99 ) / tsc_per_ns, percentile( latency_sum, 0.999 ) / tsc_per_ns );
+        else
+            fprintf( out, ", \"p50_ns\": null, \"p99_ns\": null, \"p999_ns\": null" );
+
+        base = baseline_mpps( baseline, name );
+
+        if( base > 0 )
+        {
+            double delta = ( mpps - base ) / base * 100;
+
+            fprintf( out, ", \"baseline_mpps\": %.4f, \"delta_pct\": %.1f", base, delta );
+
+            if( delta < -tolerance )
+            {
+                printf( "REGRESSION: %s %.4f -> %.4f Mpps (%.1f%%)\n", name, base, mpps, delta );
+                regressions++;
+            }
+        }
+
+        fprintf( out, " }" );
+        fflush( out );
+        printf( "DONE: %s %.4f Mpps, cpu %.2f\n", name, mpps, cpu / wall );
+        first = 0;
+    }
+
+    fprintf( out, "\n] }\n" );
+    fclose( out );
+
+    if( baseline )
+        fclose( baseline );
+
+    return regressions ? 2 : 0;
+}
@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stdlib.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#endif
+
+#define SOQUE_WITH_LOADER
+#include "soque.h"
+
+// queue graph: producers push into SOURCES source queues, soque_link merges them into one queue,
+// whose route sends every slot to one of SINKS sink queues or drops it; one pool serves it all,
+// attached by its sources; the sinks check each source's sequence comes out in order and went through
+// every queue on the way, the small sinks hold the graph back to the producers; soque_link has to refuse
+// cycles, destinations with smaller slots and ones with a push_cb
+
+#define SOURCES 2
+#define SINKS 2
+#define DROP SINKS // route past the sinks
+
+#ifdef _WIN32
+#define load_acquire( p ) InterlockedCompareExchange( (volatile LONG *)( p ), 0, 0 )
+#define store_release( p, v ) InterlockedExchange( (volatile LONG *)( p ), ( v ) )
+#define fetch_add( p, v ) InterlockedExchangeAdd64( (volatile LONG64 *)( p ), ( v ) )
+#define load_64( p ) InterlockedCompareExchange64( (volatile LONG64 *)( p ), 0, 0 )
+#else
+#define load_acquire( p ) __atomic_load_n( ( p ), __ATOMIC_ACQUIRE )
+#define store_release( p, v ) __atomic_store_n( ( p ), ( v ), __ATOMIC_RELEASE )
+#define fetch_add( p, v ) __atomic_fetch_add( ( p ), ( v ), __ATOMIC_RELAXED )
+#define load_64( p ) __atomic_load_n( ( p ), __ATOMIC_RELAXED )
+#endif
+
+#define HOP_SOURCE 1
+#define HOP_MERGE 2
+#define HOP_SINK 4
+
+typedef struct
+{
+    uint32_t source;
+    uint32_t dest; // sink, DROP = none
+    uint32_t hops; // queues that processed it
+    uint32_t pad;
+    uint64_t seq;
+} SLOT;
+
+typedef struct
+{
+    SOQUE_HANDLE q;
+    uint32_t id;
+    uint32_t hop;
+    uint64_t next[SOURCES]; // sinks: lowest sequence each source may come with, pop owner only
+} NODE;
+
+static NODE g_sources[SOURCES];
+static NODE g_merge;
+static NODE g_sinks[SINKS];
+static uint32_t g_stop;
+static long long g_pushed;
+static long long g_dropped;
+static long long g_popped;
+static long long g_errors;
+
+#define slot( n, i ) ( (SLOT *)soq->soque_slot( ( n )->q, ( i ) ) )
+
+static void SOQUE_CALL proc_cb( void * arg, SOQUE_BATCH proc_batch )
+{
+    NODE * n = (NODE *)arg;
+    uint32_t size = soq->soque_resize( n->q, 0 );
+    uint32_t i = proc_batch.index;
+    uint32_t c;
+
+    for( c = proc_batch.count; c; c-- )
+    {
+        slot( n, i )->hops |= n->hop;
+
+        if( ++i == size )
+            i = 0;
+    }
+}
+
+static uint32_t SOQUE_CALL idle_push_cb( void * arg, uint32_t batch, uint8_t waitable )
+{
+    (void)arg;
+    (void)batch;
+    (void)waitable;
+    return 0;
+}
+
+static uint32_t SOQUE_CALL route_cb( void * arg, void * sl )
+{
+    (void)arg;
+    return ( (SLOT *)sl )->dest;
+}
+
+static uint32_t SOQUE_CALL sink_pop_cb( void * arg, uint32_t batch, uint8_t waitable )
+{
+    NODE * n = (NODE *)arg;
+    SOQUE_BATCH pop_batch = soq->soque_pop_get( n->q, batch );
+    uint32_t size = soq->soque_resize( n->q, 0 );
+    uint32_t i = pop_batch.index;
+    uint32_t c;
+
+    (void)waitable;
+
+    for( c = pop_batch.count; c; c-- )
+    {
+        SLOT * sl = slot( n, i );
+
+        if( sl->hops != ( HOP_SOURCE | HOP_MERGE | HOP_SINK ) || sl->dest != n->id || sl->source >= SOURCES || sl->seq < n->next[sl->source] )
+        {
+            if( fetch_add( &g_errors, 1 ) < 10 )
+                printf( "ERROR: sink %u slot %u: source %u seq %llu dest %u hops %u\n", n->id, i, sl->source, (unsigned long long)sl->seq, sl->dest, sl->hops );
+        }
+        else
+        {
+            n->next[sl->source] = sl->seq + 1;
+        }
+
+        if( ++i == size )
+            i = 0;
+    }
+
+    fetch_add( &g_popped, pop_batch.count );
+
+    return pop_batch.count;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI producer_thread( LPVOID arg )
+#else
+static void * producer_thread( void * arg )
+#endif
+{
+    NODE * n = (NODE *)arg;
+    uint32_t rng = 2463534242u + n->id * 7919;
+    uint64_t seq = 0;
+    long long dropped = 0;
+
+    while( !load_acquire( &g_stop ) )
+    {
+        SOQUE_BATCH push_batch = soq->soque_push_reserve( n->q, 16 );
+        uint32_t size = soq->soque_resize( n->q, 0 );
+        uint32_t i = push_batch.index;
+        uint32_t c;
+
+        for( c = push_batch.count; c; c-- )
+        {
+            SLOT * sl = slot( n, i );
+
+            rng ^= rng << 13;
+            rng ^= rng >> 17;
+            rng ^= rng << 5;
+
+            sl->source = n->id;
+            sl->dest = rng % ( SINKS * 4 + 1 ) / 4; // one in SINKS * 4 + 1 dropped
+            sl->hops = 0;
+            sl->seq = seq++;
+
+            if( sl->dest == DROP )
+                dropped++;
+
+            if( ++i == size )
+                i = 0;
+        }
+
+        soq->soque_push_commit( n->q, push_batch );
+        fetch_add( &g_pushed, push_batch.count );
+    }
+
+    fetch_add( &g_dropped, dropped );
+
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+static void sleep_ms( uint32_t ms )
+{
+#ifdef _WIN32
+    Sleep( ms );
+#else
+    usleep( ms * 1000 );
+#endif
+}
+
+static uint8_t node_open( NODE * n, uint32_t id, uint32_t hop, uint32_t size, soque_pop_cb pop_cb )
+{
+    memset( n, 0, sizeof( NODE ) );
+    n->id = id;
+    n->hop = hop;
+    n->q = soq->soque_open_slots( size, sizeof( SLOT ), 0, n, NULL, proc_cb, pop_cb );
+
+    return n->q != NULL;
+}
+
+int main( int argc, char ** argv )
+{
+#ifdef _WIN32
+    HANDLE threads[SOURCES];
+#else
+    pthread_t threads[SOURCES];
+#endif
+    SOQUE_HANDLE sources[SOURCES];
+    SOQUE_HANDLE sinks[SINKS];
+    SOQUE_THREADS_HANDLE qt;
+    uint32_t size = 1024;
+    uint32_t threads_count = 4;
+    uint32_t duration_ms = 2000;
+    uint32_t waited;
+    uint32_t i;
+
+    if( argc > 1 )
+        size = atoi( argv[1] );
+    if( argc > 2 )
+        threads_count = atoi( argv[2] );
+    if( argc > 3 )
+        duration_ms = atoi( argv[3] );
+
+    printf( "STARTED: soque_graph %u %u %u\n", size, threads_count, duration_ms );
+
+    if( !soque_load() )
+        return 1;
+
+    for( i = 0; i < SOURCES; i++ )
+    {
+        if( !node_open( &g_sources[i], i, HOP_SOURCE, size, NULL ) )
+            return 1;
+
+        sources[i] = g_sources[i].q;
+    }
+
+    for( i = 0; i < SINKS; i++ )
+    {
+        if( !node_open( &g_sinks[i], i, HOP_SINK, size / 8 > 2 ? size / 8 : 2, sink_pop_cb ) )
+            return 1;
+
+        sinks[i] = g_sinks[i].q;
+    }
+
+    if( !node_open( &g_merge, 0, HOP_MERGE, size, NULL ) )
+        return 1;
+
+    // fan-in, then fan-out by route
+    for( i = 0; i < SOURCES; i++ )
+    {
+        if( !soq->soque_link( sources[i], &g_merge.q, 1, NULL ) )
+        {
+            printf( "ERROR: soque_link source %u = 0\n", i );
+            return 1;
+        }
+    }
+
+    if( !soq->soque_link( g_merge.q, sinks, SINKS, route_cb ) )
+    {
+        printf( "ERROR: soque_link merge = 0\n" );
+        return 1;
+    }
+
+    if( soq->soque_link( sinks[0], sources, 1, NULL ) )
+    {
+        printf( "ERROR: soque_link cycle = 1\n" );
+        return 1;
+    }
+
+    // destinations that would cut slots short or race their own push_cb
+    {
+        SOQUE_HANDLE narrow = soq->soque_open_slots( size, sizeof( SLOT ) / 2, 0, NULL, NULL, proc_cb, NULL );
+        SOQUE_HANDLE pushing = soq->soque_open_slots( size, sizeof( SLOT ), 0, NULL, idle_push_cb, proc_cb, NULL );
+
+        if( !narrow || !pushing )
+        {
+            printf( "ERROR: soque_open_slots = NULL\n" );
+            return 1;
+        }
+
+        if( soq->soque_link( sinks[0], &narrow, 1, NULL ) || soq->soque_link( sinks[0], &pushing, 1, NULL ) )
+        {
+            printf( "ERROR: soque_link narrow / push_cb = 1\n" );
+            return 1;
+        }
+
+        soq->soque_close( narrow );
+        soq->soque_close( pushing );
+    }
+
+    qt = soq->soque_threads_open( threads_count, 0, sources, SOURCES );
+
+    for( i = 0; i < SOURCES; i++ )
+    {
+#ifdef _WIN32
+        threads[i] = CreateThread( NULL, 0, producer_thread, &g_sources[i], 0, NULL );
+#else
+        pthread_create( &threads[i], NULL, producer_thread, &g_sources[i] );
+#endif
+    }
+
+    sleep_ms( duration_ms );
+    store_release( &g_stop, 1 );
+
+    for( i = 0; i < SOURCES; i++ )
+    {
+#ifdef _WIN32
+        WaitForSingleObject( threads[i], INFINITE );
+        CloseHandle( threads[i] );
+#else
+        pthread_join( threads[i], NULL );
+#endif
+    }
+
+    // the pool drains the graph
+    for( waited = 0; load_64( &g_popped ) + g_dropped < g_pushed && waited < 5000; waited += 10 )
+        sleep_ms( 10 );
+
+    soq->soque_threads_close( qt );
+
+    printf( "graph  %u sources  %u sinks   %lld pushed  %lld popped  %lld dropped   %lld errors\n", SOURCES, SINKS, g_pushed, g_popped, g_dropped, g_errors );
+
+    if( g_popped + g_dropped != g_pushed )
+    {
+        printf( "ERROR: %lld slots lost\n", g_pushed - g_popped - g_dropped );
+        g_errors++;
+    }
+
+    for( i = 0; i < SOURCES; i++ )
+        soq->soque_close( sources[i] );
+
+    soq->soque_close( g_merge.q );
+
+    for( i = 0; i < SINKS; i++ )
+        soq->soque_close( sinks[i] );
+
+    return g_errors ? 1 : 0;
+}
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <chrono>
+
+#include "soque.hpp"
+
+// soque_test over soque.hpp: queues of compile-time size, lambdas for push, proc and pop inlined into
+// the pool's workers; every slot carries its sequence, proc transforms it and pop checks both in order
+
+#ifdef _WIN32
+#include <intrin.h>
+#define rdtsc() __rdtsc()
+#else
+#define rdtsc() __builtin_ia32_rdtsc()
+#endif
+
+#define QUEUE_SIZE 2048
+#define QUEUES 2
+
+struct SLOT
+{
+    uint64_t seq;
+    uint64_t out;
+};
+
+struct STREAM
+{
+    soque::queue<SLOT, QUEUE_SIZE> q;
+    uint64_t push_seq; // push owner only
+    uint64_t pop_seq; // pop owner only
+    std::atomic<uint64_t> errors;
+};
+
+static uint64_t transform( uint64_t v )
+{
+    return ( v * 0x9E3779B97F4A7C15ULL ) | 1;
+}
+
+static void spin( uint64_t tsc )
+{
+    uint64_t c = rdtsc();
+
+    while( rdtsc() - c < tsc )
+        continue;
+}
+
+int main( int argc, char ** argv )
+{
+    static STREAM s[QUEUES];
+    uint32_t threads = 0;
+    uint64_t proctsc = 0;
+    uint32_t seconds = 5;
+    uint64_t errors = 0;
+    uint64_t last = 0;
+
+    if( argc > 1 )
+        threads = atoi( argv[1] );
+    if( argc > 2 )
+        proctsc = atoi( argv[2] );
+    if( argc > 3 )
+        seconds = atoi( argv[3] );
+
+    printf( "STARTED: soque_inline %u %u %u\n", threads, (unsigned)proctsc, seconds );
+    printf( "INFO: queue_size = %u\n", QUEUE_SIZE );
+    printf( "INFO: queue_count = %u\n\n", QUEUES );
+
+    // one node per queue, each lambda is its own type
+    auto node = [proctsc]( STREAM & st )
+    {
+        return soque::make_node( st.q,
+            [&st]( SLOT & sl ) { sl.seq = st.push_seq++; sl.out = 0; return true; },
+            [proctsc]( SLOT & sl ) { if( proctsc ) spin( proctsc ); sl.out = transform( sl.seq ); },
+            [&st]( SLOT & sl ) { if( sl.seq != st.pop_seq++ || sl.out != transform( sl.seq ) ) st.errors++; return true; } );
+    };
+
+    {
+        auto pool = soque::make_pool( threads, node( s[0] ), node( s[1] ) );
+
+        for( uint32_t t = 0; t < seconds; t++ )
+        {
+            std::this_thread::sleep_for( std::chrono::seconds( 1 ) );
+
+            uint64_t now = pool->processed();
+            printf( "Mpps:   %.03f\n", (double)( now - last ) / 1000000 );
+            last = now;
+        }
+    }
+
+    for( uint32_t i = 0; i < QUEUES; i++ )
+        errors += s[i].errors;
+
+    printf( "order errors %llu\n", (unsigned long long)errors );
+
+    return errors ? 1 : 0;
+}
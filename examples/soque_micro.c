@@ -0,0 +1,512 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stdlib.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#endif
+
+#define SOQUE_WITH_LOADER
+#include "soque.h"
+
+// primitive microbenchmarks: ns per call (or per slot) of push, proc_get, proc_done and pop,
+// single threaded, with N workers on one queue, and pop scans of whole rings;
+// cache and branch misses per op come from perf_event_open where the kernel allows it
+
+// byte markers reference (soque 1.0 completion path), a cache line per field as 1.0 had them
+
+#define CACHELINE_SIZE 64
+
+#ifdef _WIN32
+#define CACHELINE_ALIGN( x ) __declspec( align( CACHELINE_SIZE ) ) x
+#else
+#define CACHELINE_ALIGN( x ) x __attribute__ ( ( aligned( CACHELINE_SIZE ) ) )
+#endif
+
+typedef struct
+{
+    CACHELINE_ALIGN( uint32_t q_push );
+    CACHELINE_ALIGN( uint32_t q_proc_run );
+    CACHELINE_ALIGN( uint32_t q_proc );
+    CACHELINE_ALIGN( uint32_t q_pop );
+    CACHELINE_ALIGN( uint32_t q_size );
+    CACHELINE_ALIGN( uint8_t markers[1] );
+} BYTES_SOQUE;
+
+static SOQUE_HANDLE SOQUE_CALL bytes_open( uint32_t size, void * cb_arg, soque_push_cb push_cb, soque_proc_cb proc_cb, soque_pop_cb pop_cb )
+{
+    BYTES_SOQUE * bq;
+
+    (void)cb_arg;
+    (void)push_cb;
+    (void)proc_cb;
+    (void)pop_cb;
+
+#ifdef _WIN32
+    bq = (BYTES_SOQUE *)_aligned_malloc( sizeof( BYTES_SOQUE ) + size, CACHELINE_SIZE );
+#else
+    if( posix_memalign( (void **)&bq, CACHELINE_SIZE, sizeof( BYTES_SOQUE ) + size ) != 0 )
+        bq = NULL;
+#endif
+
+    if( !bq )
+        return NULL;
+
+    memset( bq, 0, sizeof( BYTES_SOQUE ) + size );
+    bq->q_size = size;
+    return (SOQUE_HANDLE)bq;
+}
+
+static uint32_t SOQUE_CALL bytes_push( SOQUE_HANDLE sh, uint32_t push_count )
+{
+    BYTES_SOQUE * bq = (BYTES_SOQUE *)sh;
+    uint32_t push_max = bq->q_pop > bq->q_push ? bq->q_pop - bq->q_push - 1 : bq->q_size + bq->q_pop - bq->q_push - 1;
+
+    if( push_max == 0 || push_count == 0 )
+        return push_max;
+
+    if( push_count > push_max )
+        push_count = push_max;
+
+    bq->q_push = ( bq->q_push + push_count ) % bq->q_size;
+    return push_count;
+}
+
+static SOQUE_BATCH SOQUE_CALL bytes_proc_get( SOQUE_HANDLE sh, uint32_t proc_count )
+{
+    volatile BYTES_SOQUE * bq = (BYTES_SOQUE *)sh;
+    SOQUE_BATCH proc_batch;
+    uint32_t proc_run;
+    uint32_t proc_here;
+    uint32_t proc_max;
+    uint32_t proc_next;
+
+    do
+    {
+        proc_run = bq->q_proc_run;
+        proc_here = proc_run % bq->q_size;
+        proc_max = bq->q_push;
+
+        if( proc_max == proc_here )
+        {
+            proc_batch.count = 0;
+            return proc_batch;
+        }
+
+        proc_max = proc_max > proc_here ? proc_max - proc_here : bq->q_size + proc_max - proc_here;
+
+        if( proc_count > proc_max )
+            proc_count = proc_max;
+
+        proc_next = proc_run + proc_count;
+    }
+#ifdef _WIN32
+    while( (uint32_t)InterlockedCompareExchange( (volatile LONG *)&bq->q_proc_run, proc_next, proc_run ) != proc_run );
+#else
+    while( !__sync_bool_compare_and_swap( &bq->q_proc_run, proc_run, proc_next ) );
+#endif
+
+    proc_batch.index = proc_here;
+    proc_batch.count = proc_count;
+    return proc_batch;
+}
+
+static void SOQUE_CALL bytes_proc_done( SOQUE_HANDLE sh, SOQUE_BATCH proc_batch )
+{
+    volatile BYTES_SOQUE * bq = (BYTES_SOQUE *)sh;
+    uint32_t i = proc_batch.index;
+    uint32_t c = proc_batch.count;
+
+    for( ; c; c-- )
+    {
+        bq->markers[i] = 1;
+
+        if( ++i == bq->q_size )
+            i = 0;
+    }
+}
+
+static uint32_t SOQUE_CALL bytes_pop( SOQUE_HANDLE sh, uint32_t pop_count )
+{
+    volatile BYTES_SOQUE * bq = (BYTES_SOQUE *)sh;
+    uint32_t proc_next = bq->q_proc;
+    uint32_t pop_max;
+    uint32_t i;
+    uint32_t c;
+
+    while( proc_next != bq->q_push && bq->markers[proc_next] == 1 )
+        if( ++proc_next == bq->q_size )
+            proc_next = 0;
+
+    bq->q_proc = proc_next;
+    pop_max = proc_next >= bq->q_pop ? proc_next - bq->q_pop : bq->q_size + proc_next - bq->q_pop;
+
+    if( pop_count == 0 || pop_max == 0 )
+        return pop_max;
+
+    if( pop_count > pop_max )
+        pop_count = pop_max;
+
+    for( i = bq->q_pop, c = pop_count; c; c-- )
+    {
+        bq->markers[i] = 0;
+
+        if( ++i == bq->q_size )
+            i = 0;
+    }
+
+    bq->q_pop = i;
+    return pop_count;
+}
+
+static void SOQUE_CALL bytes_close( SOQUE_HANDLE sh )
+{
+#ifdef _WIN32
+    _aligned_free( sh );
+#else
+    free( sh );
+#endif
+}
+
+static SOQUE_FRAMEWORK bytes_soq;
+static SOQUE_FRAMEWORK ranges_soq;
+
+static SOQUE_HANDLE SOQUE_CALL ranges_open( uint32_t size, void * cb_arg, soque_push_cb push_cb, soque_proc_cb proc_cb, soque_pop_cb pop_cb )
+{
+    return soq->soque_open_ex( size, SOQUE_FLAG_RANGES, cb_arg, push_cb, proc_cb, pop_cb );
+}
+
+// time and hardware counters
+
+static double now_ns()
+{
+#ifdef _WIN32
+    LARGE_INTEGER f, c;
+    QueryPerformanceFrequency( &f );
+    QueryPerformanceCounter( &c );
+    return (double)c.QuadPart * 1e9 / f.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+#endif
+}
+
+#define COUNTERS 2 // cache misses, branch misses
+
+// start / stop pairs add up, zero it before use
+typedef struct
+{
+    int fd[COUNTERS];
+    double start;
+    double ns;
+    unsigned long long value[COUNTERS];
+    int counted;
+} METER;
+
+static void meter_start( METER * m )
+{
+    int i;
+
+    for( i = 0; i < COUNTERS; i++ )
+    {
+        m->fd[i] = -1;
+
+#ifdef __linux__
+        {
+            struct perf_event_attr pe;
+
+            memset( &pe, 0, sizeof( pe ) );
+            pe.type = PERF_TYPE_HARDWARE;
+            pe.size = sizeof( pe );
+            pe.config = i == 0 ? PERF_COUNT_HW_CACHE_MISSES : PERF_COUNT_HW_BRANCH_MISSES;
+            pe.disabled = 1;
+            pe.inherit = 1; // worker threads started inside the region
+            pe.exclude_kernel = 1;
+            pe.exclude_hv = 1;
+
+            m->fd[i] = (int)syscall( SYS_perf_event_open, &pe, 0, -1, -1, 0 );
+
+            if( m->fd[i] >= 0 )
+            {
+                ioctl( m->fd[i], PERF_EVENT_IOC_RESET, 0 );
+                ioctl( m->fd[i], PERF_EVENT_IOC_ENABLE, 0 );
+            }
+        }
+#endif
+    }
+
+    m->start = now_ns();
+}
+
+static void meter_stop( METER * m )
+{
+    int i;
+
+    m->ns += now_ns() - m->start;
+
+    for( i = 0; i < COUNTERS; i++ )
+    {
+        if( m->fd[i] < 0 )
+            continue;
+
+#ifdef __linux__
+        {
+            unsigned long long value;
+
+            ioctl( m->fd[i], PERF_EVENT_IOC_DISABLE, 0 );
+
+            if( read( m->fd[i], &value, sizeof( value ) ) == sizeof( value ) )
+            {
+                m->value[i] += value;
+                m->counted = 1;
+            }
+
+            close( m->fd[i] );
+        }
+#endif
+    }
+}
+
+static void report( const char * impl, const char * op, uint32_t size, uint32_t batch, uint32_t workers, const METER * m, unsigned long long ops, const char * per )
+{
+    printf( "%-7s %-16s size = %-6u batch = %-4u workers = %-2u %9.2f ns/%s", impl, op, size, batch, workers, m->ns / ops, per );
+
+    if( m->counted )
+        printf( "   %7.3f cache-miss/%s   %7.3f branch-miss/%s\n", (double)m->value[0] / ops, per, (double)m->value[1] / ops, per );
+    else
+        printf( "   (no perf counters)\n" );
+}
+
+// single thread: rounds of fill the ring, proc it in batches, retire it with one long pop scan
+
+static void bench_single( const char * impl, const SOQUE_FRAMEWORK * f, uint32_t size, uint32_t batch, uint32_t rounds )
+{
+    SOQUE_HANDLE q = f->soque_open( size, NULL, NULL, NULL, NULL );
+    SOQUE_BATCH * batches = (SOQUE_BATCH *)malloc( sizeof( SOQUE_BATCH ) * ( size / batch + 2 ) );
+    METER m_push, m_get, m_done, m_scan, m_clear;
+    unsigned long long push_calls = 0, get_calls = 0, slots = 0;
+    uint32_t r, n, k;
+
+    if( !q || !batches )
+    {
+        printf( "ERROR: %s: soque_open = NULL\n", impl );
+        return;
+    }
+
+    memset( &m_push, 0, sizeof( METER ) );
+    memset( &m_get, 0, sizeof( METER ) );
+    memset( &m_done, 0, sizeof( METER ) );
+    memset( &m_scan, 0, sizeof( METER ) );
+    memset( &m_clear, 0, sizeof( METER ) );
+
+    for( r = 0; r < rounds; r++ )
+    {
+        uint32_t queued = 0;
+
+        meter_start( &m_push );
+        while( ( n = f->soque_push( q, batch ) ) != 0 )
+        {
+            queued += n;
+            push_calls++;
+        }
+        meter_stop( &m_push );
+
+        meter_start( &m_get );
+        for( n = 0; ( batches[n] = f->soque_proc_get( q, batch ) ).count; n++ );
+        meter_stop( &m_get );
+        get_calls += n;
+
+        meter_start( &m_done );
+        for( k = 0; k < n; k++ )
+            f->soque_proc_done( q, batches[k] );
+        meter_stop( &m_done );
+
+        meter_start( &m_scan );
+        if( queued != f->soque_pop( q, 0 ) )
+            printf( "ERROR: %s: pop scan mismatch\n", impl );
+        meter_stop( &m_scan );
+
+        meter_start( &m_clear );
+        f->soque_pop( q, queued );
+        meter_stop( &m_clear );
+
+        slots += queued;
+    }
+
+    report( impl, "push", size, batch, 1, &m_push, push_calls, "call" );
+    report( impl, "proc_get", size, batch, 1, &m_get, get_calls, "call" );
+    report( impl, "proc_done", size, batch, 1, &m_done, get_calls, "call" );
+    report( impl, "pop scan", size, batch, 1, &m_scan, slots, "slot" );
+    report( impl, "pop clear", size, batch, 1, &m_clear, slots, "slot" );
+
+    free( batches );
+    f->soque_close( q );
+}
+
+// N workers hammer proc_get + proc_done on one queue, one feeder pushes and pops
+
+static const SOQUE_FRAMEWORK * c_f;
+static SOQUE_HANDLE c_q;
+static uint32_t c_batch;
+static volatile uint32_t c_stop;
+static volatile long long c_calls;
+
+#ifdef _WIN32
+static DWORD WINAPI worker_thread( LPVOID arg )
+#else
+static void * worker_thread( void * arg )
+#endif
+{
+    long long calls = 0;
+
+    (void)arg;
+
+    while( !c_stop )
+    {
+        SOQUE_BATCH proc_batch = c_f->soque_proc_get( c_q, c_batch );
+
+        calls++;
+
+        if( proc_batch.count )
+            c_f->soque_proc_done( c_q, proc_batch );
+    }
+
+#ifdef _WIN32
+    InterlockedExchangeAdd64( &c_calls, calls );
+    return 0;
+#else
+    __sync_fetch_and_add( &c_calls, calls );
+    return NULL;
+#endif
+}
+
+static void bench_contended( const char * impl, const SOQUE_FRAMEWORK * f, uint32_t size, uint32_t batch, uint32_t workers, uint32_t duration_ms )
+{
+#ifdef _WIN32
+    HANDLE threads[64];
+#else
+    pthread_t threads[64];
+#endif
+    METER m;
+    double end;
+    uint32_t i;
+
+    c_f = f;
+    c_q = f->soque_open( size, NULL, NULL, NULL, NULL );
+    c_batch = batch;
+    c_stop = 0;
+    c_calls = 0;
+
+    if( !c_q )
+    {
+        printf( "ERROR: %s: soque_open = NULL\n", impl );
+        return;
+    }
+
+    if( workers > 64 )
+        workers = 64;
+
+    memset( &m, 0, sizeof( METER ) );
+    meter_start( &m );
+
+    for( i = 0; i < workers; i++ )
+    {
+#ifdef _WIN32
+        threads[i] = CreateThread( NULL, 0, worker_thread, NULL, 0, NULL );
+#else
+        pthread_create( &threads[i], NULL, worker_thread, NULL );
+#endif
+    }
+
+    for( end = now_ns() + duration_ms * 1e6; now_ns() < end; )
+    {
+        f->soque_push( c_q, f->soque_push( c_q, 0 ) );
+        f->soque_pop( c_q, f->soque_pop( c_q, 0 ) );
+    }
+
+    c_stop = 1;
+
+    for( i = 0; i < workers; i++ )
+    {
+#ifdef _WIN32
+        WaitForSingleObject( threads[i], INFINITE );
+        CloseHandle( threads[i] );
+#else
+        pthread_join( threads[i], NULL );
+#endif
+    }
+
+    meter_stop( &m );
+
+    // worker time per proc_get + proc_done, so ns/call grows with contention
+    m.ns *= workers;
+    report( impl, "proc_get+done", size, batch, workers, &m, c_calls ? c_calls : 1, "call" );
+
+    f->soque_close( c_q );
+}
+
+int main( int argc, char ** argv )
+{
+    uint32_t sizes[] = { 1024, 16384, 65536 };
+    const char * names[] = { "bytes", "soque", "ranges" };
+    const SOQUE_FRAMEWORK * impls[3];
+    uint32_t batch = 16;
+    uint32_t rounds = 1000;
+    uint32_t max_workers = 4;
+    uint32_t duration_ms = 500;
+    uint32_t i, k, w;
+
+    if( argc > 1 )
+        batch = atoi( argv[1] );
+    if( argc > 2 )
+        rounds = atoi( argv[2] );
+    if( argc > 3 )
+        max_workers = atoi( argv[3] );
+    if( argc > 4 )
+        duration_ms = atoi( argv[4] );
+
+    printf( "STARTED: soque_micro %d %d %d %d\n", batch, rounds, max_workers, duration_ms );
+
+    if( batch == 0 )
+        batch = 1;
+
+    if( !soque_load() )
+        return 1;
+
+    bytes_soq = *soq;
+    bytes_soq.soque_open = bytes_open;
+    bytes_soq.soque_push = bytes_push;
+    bytes_soq.soque_proc_get = bytes_proc_get;
+    bytes_soq.soque_proc_done = bytes_proc_done;
+    bytes_soq.soque_pop = bytes_pop;
+    bytes_soq.soque_close = bytes_close;
+
+    ranges_soq = *soq;
+    ranges_soq.soque_open = ranges_open;
+
+    impls[0] = &bytes_soq;
+    impls[1] = soq;
+    impls[2] = &ranges_soq;
+
+    for( i = 0; i < sizeof( sizes ) / sizeof( sizes[0] ); i++ )
+        for( k = 0; k < 3; k++ )
+            bench_single( names[k], impls[k], sizes[i], batch, rounds );
+
+    for( w = 1; w <= max_workers; w *= 2 )
+        for( k = 0; k < 3; k++ )
+            bench_contended( names[k], impls[k], 1024, batch, w, duration_ms );
+
+    return 0;
+}
@@ -0,0 +1,700 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stdlib.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <pthread.h>
+#endif
+
+#ifdef __linux__
+#include <poll.h>
+#endif
+
+#define SOQUE_WITH_LOADER
+#include "soque.h"
+
+// strict order stress: producers stamp ( producer, sequence ) into slots through push_reserve / push_commit,
+// workers transform them between proc_get and proc_done, poppers racing for pop_enter check that every
+// producer's sequence comes out whole, in order and transformed; the payload is plain memory in the queue's
+// slots, so the ring indices, markers and guards are all that orders it (make order_tsan runs it under ThreadSanitizer,
+// make order_latency with SOQUE_LATENCY stamps in the markers area);
+// the resize runs do the same while a resizer thread keeps switching the ring between g_size * 2 and g_size / 4,
+// the huge one with the rings on huge pages; the stages runs have workers pick a random stage of three,
+// each stage transforms what the one before it left; the events runs have their one producer and one popper block
+// on soque_event_fd when there is no room / nothing to pop, and fail if slots wait through a timeout unannounced,
+// eventsF on a flow queue, where slots done past an unfinished head are poppable too;
+// the flows run keys slots by FLOW_KEYS flows, checks each producer's sequence stays in order within a flow
+// and that flows overtake each other, slots released early past a slow one; the attach runs check a worker pool
+// keeps serving queues attached after it started, from none or next to an idle one, and the rest after a detach
+
+#define MAX_THREADS 64
+#define SEQ_BITS 48
+#define SEQ_MASK ( ( (uint64_t)1 << SEQ_BITS ) - 1 )
+#define MAX_ERRORS 10
+#define EVENT_TIMEOUT_MS 100
+
+// run modes
+#define MODE_RESIZE 0x01 // a resizer thread switches the ring size
+#define MODE_EVENTS 0x02 // producer and popper sleep on event fds
+#define MODE_FLOWS 0x04 // soque_open_flows, payload in g_slots
+
+#define FLOW_KEYS 8
+#define ATTACH_QUEUES 2
+#define ATTACH_CHURN 1000
+
+#ifdef _WIN32
+#define load_acquire( p ) InterlockedCompareExchange( (volatile LONG *)( p ), 0, 0 )
+#define store_release( p, v ) InterlockedExchange( (volatile LONG *)( p ), ( v ) )
+#define fetch_add( p, v ) InterlockedExchangeAdd64( (volatile LONG64 *)( p ), ( v ) )
+#else
+#define load_acquire( p ) __atomic_load_n( ( p ), __ATOMIC_ACQUIRE )
+#define store_release( p, v ) __atomic_store_n( ( p ), ( v ), __ATOMIC_RELEASE )
+#define fetch_add( p, v ) __atomic_fetch_add( ( p ), ( v ), __ATOMIC_RELAXED )
+#endif
+
+static SOQUE_HANDLE g_q;
+static uint32_t g_size;
+static uint32_t g_batch;
+static uint32_t g_stages; // 1 = proc_get / proc_done
+static uint32_t g_stop;
+static long long g_resizes;
+static int g_push_fd; // -1 = spin
+static int g_pop_fd;
+static long long g_wakes;
+static uint32_t * g_keys; // flow key per slot
+static uint64_t g_flow_next[MAX_THREADS][FLOW_KEYS]; // lowest sequence a flow may come with, pop guard owner only
+static long long g_overtaken; // slots popped after a later one of their producer
+static uint64_t g_next[MAX_THREADS]; // next expected sequence per producer, pop guard owner only
+static long long g_items;
+static long long g_errors;
+
+typedef struct
+{
+    uint32_t id;
+    uint32_t rng;
+} ROLE;
+
+typedef struct
+{
+    uint64_t in; // producer stamp, 0 = free
+    uint64_t out; // worker transform per stage, 0 = not processed
+} SLOT;
+
+static SLOT * g_slots; // flows have no slots of their own
+
+// pool side of the attach runs, the cb_arg of a queue
+typedef struct
+{
+    uint32_t idle; // push nothing
+    long long pushed;
+    long long popped;
+} POOL_COUNTS;
+
+#define slot( i ) ( g_slots ? &g_slots[i] : (SLOT *)soq->soque_slot( g_q, ( i ) ) )
+
+static uint32_t next_rand( ROLE * r )
+{
+    r->rng ^= r->rng << 13;
+    r->rng ^= r->rng >> 17;
+    r->rng ^= r->rng << 5;
+    return r->rng;
+}
+
+static uint64_t transform( uint64_t v )
+{
+    return ( v * 0x9E3779B97F4A7C15ULL ) | 1;
+}
+
+// out of a slot past stage - 1
+static uint64_t staged( uint64_t in, uint32_t stage )
+{
+    uint64_t v = in;
+
+    if( stage == 0 )
+        return 0;
+
+    while( stage-- )
+        v = transform( v );
+
+    return v;
+}
+
+static void error( const char * what, uint32_t i, uint64_t in, uint64_t out )
+{
+    if( fetch_add( &g_errors, 1 ) < MAX_ERRORS )
+        printf( "ERROR: %s at slot %u: in %016llx out %016llx\n", what, i, (unsigned long long)in, (unsigned long long)out );
+}
+
+static void sleep_ms( uint32_t ms )
+{
+#ifdef _WIN32
+    Sleep( ms );
+#else
+    usleep( ms * 1000 );
+#endif
+}
+
+// 1 = woken (and cleared), 0 = timeout
+static uint8_t event_wait( int fd )
+{
+#ifdef __linux__
+    struct pollfd pfd;
+    uint64_t value;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    if( poll( &pfd, 1, EVENT_TIMEOUT_MS ) <= 0 )
+        return 0;
+
+    if( read( fd, &value, sizeof( value ) ) > 0 )
+        fetch_add( &g_wakes, 1 );
+
+    return 1;
+#else
+    (void)fd;
+    return 0;
+#endif
+}
+
+#ifdef _WIN32
+static DWORD WINAPI producer_thread( LPVOID arg )
+#else
+static void * producer_thread( void * arg )
+#endif
+{
+    ROLE * r = (ROLE *)arg;
+    uint64_t seq = 0;
+
+    while( !load_acquire( &g_stop ) )
+    {
+        SOQUE_BATCH push_batch = soq->soque_push_reserve( g_q, 1 + next_rand( r ) % g_batch );
+        uint32_t size = soq->soque_resize( g_q, 0 ); // no switch while the reservation is open
+        uint32_t i = push_batch.index;
+        uint32_t c;
+
+        for( c = push_batch.count; c; c-- )
+        {
+            SLOT * sl = slot( i );
+
+            if( sl->in || sl->out )
+                error( "slot reused before pop", i, sl->in, sl->out );
+
+            sl->in = ( (uint64_t)( r->id + 1 ) << SEQ_BITS ) | seq++;
+
+            if( g_keys )
+                g_keys[i] = next_rand( r ) % FLOW_KEYS;
+
+            if( ++i == size )
+                i = 0;
+        }
+
+        soq->soque_push_commit( g_q, push_batch );
+
+        // a timeout is fine while there is no room, twice in a row with room is a lost wake
+        if( push_batch.count == 0 && g_push_fd >= 0 && !event_wait( g_push_fd ) )
+            if( soq->soque_push_reserve( g_q, 0 ).count >= g_batch && !event_wait( g_push_fd ) && !load_acquire( &g_stop ) )
+                error( "push event lost", 0, 0, 0 );
+    }
+
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker_thread( LPVOID arg )
+#else
+static void * worker_thread( void * arg )
+#endif
+{
+    ROLE * r = (ROLE *)arg;
+
+    while( !load_acquire( &g_stop ) )
+    {
+        uint32_t stage = next_rand( r ) % g_stages;
+        SOQUE_BATCH proc_batch = g_stages > 1 ? soq->soque_stage_get( g_q, stage, 1 + next_rand( r ) % g_batch ) : soq->soque_proc_get( g_q, 1 + next_rand( r ) % g_batch );
+        uint32_t size = soq->soque_resize( g_q, 0 );
+        uint32_t i = proc_batch.index;
+        uint32_t c;
+
+        for( c = proc_batch.count; c; c-- )
+        {
+            SLOT * sl = slot( i );
+
+            if( sl->in == 0 || sl->out != staged( sl->in, stage ) )
+                error( stage ? "stage before the previous one" : "proc of an unpushed slot", i, sl->in, sl->out );
+
+            sl->out = transform( stage ? sl->out : sl->in );
+
+            if( ++i == size )
+                i = 0;
+        }
+
+        // finish out of order now and then
+        if( proc_batch.count && next_rand( r ) % 4 == 0 )
+        {
+            volatile uint32_t spin = next_rand( r ) % 2048;
+            while( spin )
+                spin--;
+
+            // long enough for the other flows to pass this batch's
+            if( g_keys && next_rand( r ) % 16 == 0 )
+                sleep_ms( 1 );
+        }
+
+        if( g_stages > 1 )
+            soq->soque_stage_done( g_q, stage, proc_batch );
+        else
+            soq->soque_proc_done( g_q, proc_batch );
+    }
+
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+#ifdef _WIN32
+static DWORD WINAPI popper_thread( LPVOID arg )
+#else
+static void * popper_thread( void * arg )
+#endif
+{
+    ROLE * r = (ROLE *)arg;
+    long long items = 0;
+
+    while( !load_acquire( &g_stop ) )
+    {
+        SOQUE_BATCH pop_batch;
+        uint32_t size;
+        uint32_t i;
+        uint32_t c;
+
+        if( !soq->soque_pop_enter( g_q ) )
+            continue;
+
+        pop_batch = soq->soque_pop_get( g_q, 1 + next_rand( r ) % g_batch );
+
+        // the empty pop_get armed it; slots through two timeouts unannounced are a lost wake
+        if( pop_batch.count == 0 && g_pop_fd >= 0 )
+        {
+            uint8_t woken = event_wait( g_pop_fd );
+
+            if( !woken && soq->soque_pop_get( g_q, 1 ).count && !event_wait( g_pop_fd ) && !load_acquire( &g_stop ) )
+                error( "pop event lost", 0, 0, 0 );
+
+            soq->soque_pop_leave( g_q );
+            continue;
+        }
+
+        size = soq->soque_resize( g_q, 0 );
+        i = pop_batch.index;
+
+        for( c = pop_batch.count; c; c-- )
+        {
+            SLOT * sl = slot( i );
+            uint64_t in = sl->in;
+            uint32_t p = (uint32_t)( in >> SEQ_BITS ) - 1;
+
+            if( sl->out != staged( in, g_stages ) )
+                error( "pop of an unprocessed slot", i, in, sl->out );
+            else if( p >= MAX_THREADS )
+                error( "unknown producer", i, in, sl->out );
+            else if( g_keys )
+            {
+                uint32_t key = g_keys[i];
+
+                if( key >= FLOW_KEYS )
+                    error( "unknown flow", i, in, key );
+                else if( ( in & SEQ_MASK ) < g_flow_next[p][key] )
+                    error( "out of order in flow", i, in, g_flow_next[p][key] );
+                else
+                    g_flow_next[p][key] = ( in & SEQ_MASK ) + 1;
+
+                if( ( in & SEQ_MASK ) < g_next[p] )
+                    g_overtaken++;
+                else
+                    g_next[p] = ( in & SEQ_MASK ) + 1;
+            }
+            else if( ( in & SEQ_MASK ) != g_next[p] )
+                error( "out of order", i, in, g_next[p] );
+
+            // resync after an error, so every break counts once
+            if( p < MAX_THREADS && !g_keys )
+                g_next[p] = ( in & SEQ_MASK ) + 1;
+
+            sl->in = 0;
+            sl->out = 0;
+
+            if( ++i == size )
+                i = 0;
+        }
+
+        soq->soque_pop_done( g_q, pop_batch );
+        soq->soque_pop_leave( g_q );
+
+        items += pop_batch.count;
+    }
+
+    fetch_add( &g_items, items );
+
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+#ifdef _WIN32
+static DWORD WINAPI resizer_thread( LPVOID arg )
+#else
+static void * resizer_thread( void * arg )
+#endif
+{
+    ROLE * r = (ROLE *)arg;
+    uint32_t last = g_size;
+    long long resizes = 0;
+
+    while( !load_acquire( &g_stop ) )
+    {
+        uint32_t size = g_size * 2 >> next_rand( r ) % 4;
+        uint32_t now = soq->soque_resize( g_q, 0 );
+
+        // switches seen, a request waits for the batches in proc, or for the queue to drain
+        if( now != last )
+            resizes++;
+
+        last = now;
+
+        if( size >= 2 && size != now )
+            soq->soque_resize( g_q, size );
+
+        sleep_ms( 1 );
+    }
+
+    fetch_add( &g_resizes, resizes );
+
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+static uint32_t SOQUE_CALL pool_push_cb( void * arg, uint32_t batch, uint8_t waitable )
+{
+    POOL_COUNTS * pc = (POOL_COUNTS *)arg;
+
+    (void)waitable;
+
+    if( pc->idle )
+        return 0;
+
+    fetch_add( &pc->pushed, batch );
+    return batch;
+}
+
+static void SOQUE_CALL pool_proc_cb( void * arg, SOQUE_BATCH proc_batch )
+{
+    (void)arg;
+    (void)proc_batch;
+}
+
+static uint32_t SOQUE_CALL pool_pop_cb( void * arg, uint32_t batch, uint8_t waitable )
+{
+    POOL_COUNTS * pc = (POOL_COUNTS *)arg;
+
+    (void)waitable;
+    fetch_add( &pc->popped, batch );
+    return batch;
+}
+
+// popped since before, an error if a queue that pushes got nothing through
+static long long pool_moved( const char * mode, const char * when, POOL_COUNTS * pcs, long long * before, uint32_t from, uint32_t to )
+{
+    long long moved = 0;
+    uint32_t i;
+
+    for( i = from; i < to; i++ )
+    {
+        long long popped = load_acquire( &pcs[i].popped );
+
+        if( !pcs[i].idle && popped == before[i] )
+        {
+            printf( "ERROR: %s: queue %u not served %s\n", mode, i, when );
+            g_errors++;
+        }
+
+        moved += popped - before[i];
+        before[i] = popped;
+    }
+
+    return moved;
+}
+
+// a pool of threads opened with the first attached queues, the first one idle if any, the rest attached later,
+// then the first detached and attached over and over and left detached (make order_asan catches a worker
+// still in a set freed under it); each step gets a third of duration_ms for the pool to settle and move items
+static long long attach_run( const char * mode, uint32_t threads, uint32_t attached, uint32_t duration_ms )
+{
+    SOQUE_HANDLE q[ATTACH_QUEUES];
+    SOQUE_THREADS_HANDLE qt;
+    POOL_COUNTS pcs[ATTACH_QUEUES];
+    long long before[ATTACH_QUEUES];
+    uint32_t i;
+
+    memset( pcs, 0, sizeof( pcs ) );
+    memset( before, 0, sizeof( before ) );
+    g_items = 0;
+    g_errors = 0;
+
+    for( i = 0; i < ATTACH_QUEUES; i++ )
+    {
+        pcs[i].idle = i == 0 && attached > 0;
+        q[i] = soq->soque_open_ex( g_size, 0, &pcs[i], pool_push_cb, pool_proc_cb, pool_pop_cb );
+
+        if( !q[i] )
+        {
+            printf( "ERROR: %s: soque_open = NULL\n", mode );
+
+            while( i-- )
+                soq->soque_close( q[i] );
+
+            return 1;
+        }
+    }
+
+    qt = soq->soque_threads_open( threads, 0, q, attached );
+
+    if( !qt )
+    {
+        printf( "ERROR: %s: soque_threads_open = NULL\n", mode );
+        g_errors++;
+    }
+    else
+    {
+        // workers past the homes park meanwhile
+        sleep_ms( duration_ms / 3 );
+        g_items += pool_moved( mode, "before attach", pcs, before, 0, attached );
+
+        for( i = attached; i < ATTACH_QUEUES; i++ )
+            soq->soque_threads_attach( qt, q[i] );
+
+        sleep_ms( duration_ms / 3 );
+        g_items += pool_moved( mode, "after attach", pcs, before, 0, ATTACH_QUEUES );
+
+        // sets published back to back while workers take them, the last one without the first queue
+        for( i = 0; i < ATTACH_CHURN; i++ )
+        {
+            soq->soque_threads_detach( qt, q[0], 1 );
+            soq->soque_threads_attach( qt, q[0] );
+        }
+
+        soq->soque_threads_detach( qt, q[0], 1 );
+
+        sleep_ms( duration_ms / 3 );
+        g_items += pool_moved( mode, "after detach", pcs, before, 1, ATTACH_QUEUES );
+
+        soq->soque_threads_close( qt );
+    }
+
+    for( i = 0; i < ATTACH_QUEUES; i++ )
+        soq->soque_close( q[i] );
+
+    printf( "order %-7s  %u threads  %u+%u queues   %lld items   %lld errors\n", mode, threads, attached, ATTACH_QUEUES - attached, g_items, g_errors );
+
+    return g_errors;
+}
+
+static long long run( const char * mode, uint32_t flags, uint32_t stages, uint32_t modes, uint32_t producers, uint32_t workers, uint32_t poppers, uint32_t duration_ms )
+{
+#ifdef _WIN32
+    HANDLE threads[MAX_THREADS * 3 + 1];
+#else
+    pthread_t threads[MAX_THREADS * 3 + 1];
+#endif
+    ROLE roles[MAX_THREADS * 3 + 1];
+    uint32_t count = 0;
+    uint32_t i;
+
+    g_slots = NULL;
+    g_keys = NULL;
+
+    if( modes & MODE_FLOWS )
+    {
+        g_slots = (SLOT *)calloc( g_size, sizeof( SLOT ) );
+        g_q = g_slots ? soq->soque_open_flows( g_size, flags, NULL, NULL, NULL, NULL ) : NULL;
+        g_keys = g_q ? soq->soque_flow_keys( g_q ) : NULL;
+    }
+    else if( stages > 1 )
+        g_q = soq->soque_open_stages( g_size, sizeof( SLOT ), stages, flags, NULL, NULL, NULL, NULL );
+    else
+        g_q = soq->soque_open_slots( g_size, sizeof( SLOT ), flags, NULL, NULL, NULL, NULL );
+
+    if( !g_q )
+    {
+        printf( "ERROR: %s: soque_open = NULL\n", mode );
+        free( g_slots );
+        g_slots = NULL;
+        return 1;
+    }
+
+    g_stages = stages;
+    g_push_fd = -1;
+    g_pop_fd = -1;
+
+    // one waiter per fd, a wake is read by whoever polls first
+    if( modes & MODE_EVENTS )
+    {
+        producers = 1;
+        poppers = 1;
+        g_push_fd = soq->soque_event_fd( g_q, SOQUE_EVENT_PUSH, g_batch );
+        g_pop_fd = soq->soque_event_fd( g_q, SOQUE_EVENT_POP, 0 );
+
+        if( g_push_fd < 0 || g_pop_fd < 0 )
+        {
+            printf( "ERROR: %s: soque_event_fd = -1\n", mode );
+            soq->soque_close( g_q );
+            return 1;
+        }
+    }
+
+    memset( g_next, 0, sizeof( g_next ) );
+    memset( g_flow_next, 0, sizeof( g_flow_next ) );
+    g_overtaken = 0;
+    g_stop = 0;
+    g_items = 0;
+    g_errors = 0;
+    g_resizes = 0;
+    g_wakes = 0;
+
+    for( i = 0; i < producers + workers + poppers; i++ )
+    {
+        roles[i].id = i < producers ? i : i < producers + workers ? i - producers : i - producers - workers;
+        roles[i].rng = 2463534242u + i * 7919;
+
+#ifdef _WIN32
+        threads[i] = CreateThread( NULL, 0, i < producers ? producer_thread : i < producers + workers ? worker_thread : popper_thread, &roles[i], 0, NULL );
+#else
+        pthread_create( &threads[i], NULL, i < producers ? producer_thread : i < producers + workers ? worker_thread : popper_thread, &roles[i] );
+#endif
+        count++;
+    }
+
+    if( modes & MODE_RESIZE )
+    {
+        roles[count].id = 0;
+        roles[count].rng = 88675123u;
+
+#ifdef _WIN32
+        threads[count] = CreateThread( NULL, 0, resizer_thread, &roles[count], 0, NULL );
+#else
+        pthread_create( &threads[count], NULL, resizer_thread, &roles[count] );
+#endif
+        count++;
+    }
+
+    sleep_ms( duration_ms );
+    store_release( &g_stop, 1 );
+
+    for( i = 0; i < count; i++ )
+    {
+#ifdef _WIN32
+        WaitForSingleObject( threads[i], INFINITE );
+        CloseHandle( threads[i] );
+#else
+        pthread_join( threads[i], NULL );
+#endif
+    }
+
+    printf( "order %-7s  %u producers  %u workers  %u poppers   %lld items   %lld errors", mode, producers, workers, poppers, g_items, g_errors );
+
+    if( modes & MODE_RESIZE )
+        printf( "   %lld resizes", g_resizes );
+
+    if( modes & MODE_EVENTS )
+        printf( "   %lld wakes", g_wakes );
+
+    if( modes & MODE_FLOWS )
+        printf( "   %lld overtaken", g_overtaken );
+
+    printf( "\n" );
+
+    // workers finishing out of order release later flows first
+    if( ( modes & MODE_FLOWS ) && workers > 1 && g_overtaken == 0 )
+    {
+        printf( "ERROR: %s: no flow released early\n", mode );
+        g_errors++;
+    }
+
+    soq->soque_close( g_q );
+    free( g_slots );
+    g_slots = NULL;
+    g_keys = NULL;
+
+    return g_errors;
+}
+
+int main( int argc, char ** argv )
+{
+    uint32_t producers = 2;
+    uint32_t workers = 2;
+    uint32_t poppers = 2;
+    uint32_t duration_ms = 2000;
+    long long errors = 0;
+
+    g_size = 1024;
+    g_batch = 16;
+
+    if( argc > 1 )
+        g_size = atoi( argv[1] );
+    if( argc > 2 )
+        producers = atoi( argv[2] );
+    if( argc > 3 )
+        workers = atoi( argv[3] );
+    if( argc > 4 )
+        poppers = atoi( argv[4] );
+    if( argc > 5 )
+        g_batch = atoi( argv[5] );
+    if( argc > 6 )
+        duration_ms = atoi( argv[6] );
+
+    if( producers == 0 || producers > MAX_THREADS || workers == 0 || workers > MAX_THREADS || poppers == 0 || poppers > MAX_THREADS || g_batch == 0 )
+    {
+        printf( "usage: soque_order [size] [producers] [workers] [poppers] [batch] [duration_ms]\n" );
+        return 1;
+    }
+
+    printf( "STARTED: soque_order %u %u %u %u %u %u\n", g_size, producers, workers, poppers, g_batch, duration_ms );
+
+    if( !soque_load() )
+        return 1;
+
+    errors += run( "bitmap", 0, 1, 0, producers, workers, poppers, duration_ms );
+    errors += run( "ranges", SOQUE_FLAG_RANGES, 1, 0, producers, workers, poppers, duration_ms );
+    errors += run( "resize", 0, 1, MODE_RESIZE, producers, workers, poppers, duration_ms );
+    errors += run( "resizeR", SOQUE_FLAG_RANGES, 1, MODE_RESIZE, producers, workers, poppers, duration_ms );
+    errors += run( "huge", SOQUE_FLAG_HUGE, 1, MODE_RESIZE, producers, workers, poppers, duration_ms );
+    errors += run( "stages", 0, 3, 0, producers, workers, poppers, duration_ms );
+    errors += run( "stagesR", 0, 3, MODE_RESIZE, producers, workers, poppers, duration_ms );
+    errors += run( "flows", 0, 1, MODE_FLOWS, producers, workers, poppers, duration_ms );
+#ifdef __linux__
+    errors += run( "events", 0, 1, MODE_EVENTS, producers, workers, poppers, duration_ms );
+    errors += run( "eventsF", 0, 1, MODE_EVENTS | MODE_FLOWS, producers, workers, poppers, duration_ms );
+#endif
+    errors += attach_run( "attach", 2, 0, duration_ms );
+    errors += attach_run( "attachI", 2, 1, duration_ms );
+
+    return errors ? 1 : 0;
+}
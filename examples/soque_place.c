@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stdlib.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <sys/stat.h>
+#endif
+
+#define SOQUE_WITH_LOADER
+#include "soque.h"
+
+// placement check on a fake topology: SOQUE_SYSFS points the pool at a sysfs tree written here,
+// 2 nodes of 2 cores of 2 smt siblings, cpus 0-3 on node 0, 4-7 on node 1, cpu 7 isolated;
+// every bind mode is checked against what soque_threads_stats reports as each worker's cpu,
+// pins the os refuses for cpus it does not have still count as placed; soque_node must report
+// where queue memory is, never a node it was only asked for
+
+#define CPUS 8
+#define CPU_NODE( c ) ( (c) / 4 )
+#define CPU_CORE( c ) ( (c) / 2 )
+#define CPU_ISOLATED 7
+#define MAX_WORKERS 8
+
+static long long g_errors;
+
+static void SOQUE_CALL proc_cb( void * arg, SOQUE_BATCH proc_batch )
+{
+    (void)arg;
+    (void)proc_batch;
+}
+
+static void check( int ok, const char * what, const char * mode )
+{
+    if( !ok )
+    {
+        printf( "ERROR: %s: %s\n", mode, what );
+        g_errors++;
+    }
+}
+
+#ifndef _WIN32
+static int put( const char * root, const char * path, const char * text )
+{
+    char name[512];
+    char dir[512];
+    char * p;
+    FILE * f;
+
+    snprintf( name, sizeof( name ), "%s%s", root, path );
+    snprintf( dir, sizeof( dir ), "%s", name );
+
+    for( p = dir + strlen( root ) + 1; ( p = strchr( p, '/' ) ) != NULL; p++ )
+    {
+        *p = 0;
+        mkdir( dir, 0700 );
+        *p = '/';
+    }
+
+    if( ( f = fopen( name, "w" ) ) == NULL )
+        return 0;
+
+    fprintf( f, "%s\n", text );
+    fclose( f );
+
+    return 1;
+}
+
+static int fake_sysfs( const char * root )
+{
+    char path[128];
+    char text[32];
+    int ok = 1;
+    uint32_t c;
+
+    ok &= put( root, "/affinity", "0-7" );
+    ok &= put( root, "/devices/system/cpu/isolated", "7" );
+    ok &= put( root, "/devices/system/node/online", "0-1" );
+    ok &= put( root, "/devices/system/node/node0/cpulist", "0-3" );
+    ok &= put( root, "/devices/system/node/node1/cpulist", "4-7" );
+
+    for( c = 0; c < CPUS; c++ )
+    {
+        snprintf( path, sizeof( path ), "/devices/system/cpu/cpu%u/topology/thread_siblings_list", c );
+        snprintf( text, sizeof( text ), "%u-%u", c & ~1u, c | 1u );
+        ok &= put( root, path, text );
+    }
+
+    return ok;
+}
+
+static void remove_tree( const char * root )
+{
+    char cmd[600];
+    int r;
+
+    snprintf( cmd, sizeof( cmd ), "rm -rf '%s'", root );
+    r = system( cmd );
+    (void)r;
+}
+#endif
+
+// workers' cpus after the pool placed them, returns how many
+static uint32_t cpus_of( SOQUE_THREADS_HANDLE qt, int32_t * cpus )
+{
+    SOQUE_WORKER_STATS stats[MAX_WORKERS];
+    uint32_t workers = soq->soque_threads_stats( qt, NULL, NULL );
+    uint32_t t;
+
+    if( workers > MAX_WORKERS )
+        workers = MAX_WORKERS;
+
+    soq->soque_threads_stats( qt, stats, NULL );
+
+    for( t = 0; t < workers; t++ )
+        cpus[t] = stats[t].cpu;
+
+    return workers;
+}
+
+static void print_cpus( const char * mode, const int32_t * cpus, uint32_t workers )
+{
+    uint32_t t;
+
+    printf( "place %-9s", mode );
+
+    for( t = 0; t < workers; t++ )
+        printf( " %d", cpus[t] );
+
+    printf( "\n" );
+}
+
+static void check_cpus( SOQUE_THREADS_HANDLE qt, const char * mode, uint8_t bind, uint32_t expect_pinned )
+{
+    int32_t cpus[MAX_WORKERS];
+    uint32_t workers = cpus_of( qt, cpus );
+    uint32_t pinned = 0;
+    uint32_t t, u;
+
+    print_cpus( mode, cpus, workers );
+
+    for( t = 0; t < workers; t++ )
+    {
+        if( cpus[t] < 0 )
+            continue;
+
+        pinned++;
+        check( cpus[t] < CPUS, "cpu out of the topology", mode );
+        check( ( cpus[t] == CPU_ISOLATED ) == ( ( bind & SOQUE_BIND_ISOLATED ) != 0 ), "isolated cpu mixed up", mode );
+
+        for( u = 0; u < t; u++ )
+        {
+            check( cpus[u] != cpus[t], "two workers on a cpu", mode );
+
+            // smt siblings last, never with NOSMT
+            if( cpus[u] >= 0 && ( ( bind & SOQUE_BIND_NOSMT ) || workers <= CPUS / 2 - 1 ) )
+                check( CPU_CORE( cpus[u] ) != CPU_CORE( cpus[t] ), "two workers on a core", mode );
+        }
+    }
+
+    check( pinned == expect_pinned, "workers placed", mode );
+}
+
+int main( int argc, char ** argv )
+{
+#ifdef _WIN32
+    (void)argc;
+    (void)argv;
+    printf( "STARTED: soque_place\n" );
+    printf( "place skipped, no SOQUE_SYSFS on windows\n" );
+    return 0;
+#else
+    char root[] = "/tmp/soque_sysfs_XXXXXX";
+    SOQUE_HANDLE q[2];
+    SOQUE_THREADS_HANDLE qt;
+    int32_t cpus[MAX_WORKERS];
+    uint32_t workers;
+    uint32_t t;
+    int32_t node;
+
+    (void)argc;
+    (void)argv;
+
+    printf( "STARTED: soque_place\n" );
+
+    if( !mkdtemp( root ) || !fake_sysfs( root ) )
+    {
+        printf( "ERROR: fake sysfs in %s\n", root );
+        return 1;
+    }
+
+    setenv( "SOQUE_SYSFS", root, 1 );
+
+    if( !soque_load() )
+        return 1;
+
+    // a node the machine has not got is a wish, memory lands elsewhere
+    q[0] = soq->soque_open_ex( 256, SOQUE_FLAG_NODE( 0 ), NULL, NULL, proc_cb, NULL );
+    q[1] = soq->soque_open_ex( 256, SOQUE_FLAG_NODE( 200 ), NULL, NULL, proc_cb, NULL );
+
+    if( !q[0] || !q[1] )
+    {
+        printf( "ERROR: soque_open_ex = NULL\n" );
+        return 1;
+    }
+
+    node = soq->soque_node( q[1] );
+    printf( "place node      %d %d\n", soq->soque_node( q[0] ), node );
+    check( node != 200, "soque_node reports the node asked for, not the one it got", "node" );
+
+    // 3 workers spread over cores, the isolated cpu left alone
+    qt = soq->soque_threads_open( 3, SOQUE_BIND_CPUS, q, 2 );
+    check_cpus( qt, "cpus", SOQUE_BIND_CPUS, 3 );
+
+    // a worker per core, the core of the isolated cpu counts, the rest stay unbound
+    soq->soque_threads_bind( qt, SOQUE_BIND_CPUS | SOQUE_BIND_NOSMT, NULL, 0 );
+    check_cpus( qt, "nosmt", SOQUE_BIND_NOSMT, 3 );
+
+    // isolated ones only: one cpu for three workers
+    soq->soque_threads_bind( qt, SOQUE_BIND_CPUS | SOQUE_BIND_ISOLATED | SOQUE_BIND_NOSMT, NULL, 0 );
+    check_cpus( qt, "isolated", SOQUE_BIND_ISOLATED, 1 );
+
+    // a worker on the node its home queue's memory reports
+    soq->soque_threads_bind( qt, SOQUE_BIND_NODES, NULL, 0 );
+    workers = cpus_of( qt, cpus );
+    print_cpus( "nodes", cpus, workers );
+
+    for( t = 0; t < workers; t++ )
+    {
+        node = soq->soque_node( q[t % 2] );
+
+        if( node >= 0 && node < 2 )
+            check( cpus[t] >= 0 && CPU_NODE( cpus[t] ) == node, "worker off its queue's node", "nodes" );
+    }
+
+    // unbound again
+    soq->soque_threads_bind( qt, 0, NULL, 0 );
+    check_cpus( qt, "none", 0, 0 );
+
+    soq->soque_threads_close( qt );
+    soq->soque_close( q[0] );
+    soq->soque_close( q[1] );
+    remove_tree( root );
+
+    printf( "place  %lld errors\n", g_errors );
+
+    return g_errors ? 1 : 0;
+#endif
+}
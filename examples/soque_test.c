@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <dlfcn.h>
+#include <pthread.h>
 #endif
 
 #define SOQUE_WITH_LOADER
@@ -61,6 +62,42 @@ static soque_proc_cb proc_cb = &empty_soque_proc_cb;
 static soque_pop_cb pop_cb = &empty_soque_cb;
 static void ** cb_arg;
 
+// external producers: soque_push_reserve / soque_push_commit instead of push_cb
+static SOQUE_HANDLE * producer_q;
+static int producer_q_count;
+static unsigned producer_batch;
+
+#ifdef _WIN32
+static DWORD WINAPI producer_thread( LPVOID arg )
+#else
+static void * producer_thread( void * arg )
+#endif
+{
+    int i;
+
+    (void)arg;
+
+    for( ;; )
+    {
+        for( i = 0; i < producer_q_count; i++ )
+        {
+            SOQUE_BATCH push_batch = soq->soque_push_reserve( producer_q[i], producer_batch );
+
+            if( push_batch.count )
+            {
+                empty_soque_cb( NULL, push_batch.count, 0 );
+                soq->soque_push_commit( producer_q[i], push_batch );
+            }
+        }
+    }
+
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
 #ifdef _WIN32
 #define SLEEP_1_SEC Sleep( 1000 )
 #else
@@ -72,6 +109,11 @@ int main( int argc, char ** argv )
 {
     SOQUE_HANDLE * q;
     SOQUE_THREADS_HANDLE qt;
+    SOQUE_WORKER_STATS * wstats;
+    SOQUE_STATS * qstats;
+    SOQUE_SHARE * shares;
+    static uint64_t latency[SOQUE_LATENCY_BUCKETS];
+    unsigned workers;
     int queue_size = 2048;
     int queue_count = 2;
     int threads_count = 0;
@@ -79,6 +121,13 @@ int main( int argc, char ** argv )
     unsigned batch = 16;
     unsigned threshold = 10000;
     unsigned reaction = 100;
+    unsigned flags = 0;
+    int producers = 0;
+    unsigned utilization = 0;
+    unsigned workers_max = 0;
+    unsigned prio = 0;
+    unsigned weight = 1;
+    unsigned delay_us = 0;
     long long speed_save;
     double speed_change;
     double speed_approx_change;
@@ -103,8 +152,22 @@ int main( int argc, char ** argv )
         reaction = atoi( argv[7] );
     if( argc > 8 )
         proctsc = atoi( argv[8] );
+    if( argc > 9 )
+        flags = atoi( argv[9] );
+    if( argc > 10 )
+        producers = atoi( argv[10] );
+    if( argc > 11 )
+        utilization = atoi( argv[11] );
+    if( argc > 12 )
+        workers_max = atoi( argv[12] );
+    if( argc > 13 )
+        prio = atoi( argv[13] );
+    if( argc > 14 )
+        weight = atoi( argv[14] );
+    if( argc > 15 )
+        delay_us = atoi( argv[15] );
 
-    printf( "STARTED: soque_test %d %d %d %d %d %d %d %d\n", queue_size, queue_count, threads_count, bind, batch, threshold, reaction, (int)proctsc );
+    printf( "STARTED: soque_test %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d\n", queue_size, queue_count, threads_count, bind, batch, threshold, reaction, (int)proctsc, flags, producers, utilization, workers_max, prio, weight, delay_us );
     
     if( !soque_load() )
         return 1;
@@ -116,10 +179,28 @@ int main( int argc, char ** argv )
     else
         printf( "INFO: threads_count = max\n" );
     printf( "INFO: bind = %d\n", bind );
-    printf( "INFO: batch = %d\n", batch );
+    if( batch )
+        printf( "INFO: batch = %d\n", batch );
+    else
+        printf( "INFO: batch = adaptive\n" );
     printf( "INFO: threshold = %d\n", threshold );
     printf( "INFO: reaction = %d\n", reaction );
-    printf( "INFO: proctsc = %d\n\n", (int)proctsc );
+    printf( "INFO: proctsc = %d\n", (int)proctsc );
+    printf( "INFO: flags = %d\n", flags );
+    printf( "INFO: producers = %d\n", producers );
+    if( utilization )
+        printf( "INFO: utilization = %d%%\n", utilization );
+    else
+        printf( "INFO: utilization = by threshold\n" );
+    if( workers_max )
+        printf( "INFO: workers_max = %d\n", workers_max );
+    else
+        printf( "INFO: workers_max = all\n" );
+    printf( "INFO: queue 0 prio = %d, weight = %d\n", prio, weight );
+    if( delay_us )
+        printf( "INFO: delay = %d us\n\n", delay_us );
+    else
+        printf( "INFO: delay = by reaction\n\n" );
 
     cb_arg = malloc( queue_count * sizeof( void * ) );   
     q = malloc( queue_count * sizeof( void * ) );
@@ -132,7 +213,7 @@ int main( int argc, char ** argv )
 #else
         cb_arg[i] = NULL;
 #endif
-        q[i] = soq->soque_open( queue_size, cb_arg[i], push_cb, proc_cb, pop_cb );
+        q[i] = soq->soque_open_ex( queue_size, flags, cb_arg[i], producers ? NULL : push_cb, proc_cb, pop_cb );
 
         if( q[i] == NULL )
         {
@@ -144,6 +225,37 @@ int main( int argc, char ** argv )
     qt = soq->soque_threads_open( threads_count, bind, q, queue_count );
     soq->soque_threads_tune( qt, batch, threshold, reaction );
 
+    if( batch == 0 )
+        soq->soque_threads_batch( qt, 1, 1024, 100 );
+
+    if( utilization || workers_max )
+        soq->soque_threads_scale( qt, utilization, 0, workers_max );
+
+    if( prio || weight != 1 )
+        soq->soque_threads_priority( qt, q[0], prio, weight );
+
+    for( i = 0; delay_us && i < queue_count; i++ )
+        soq->soque_threads_delay( qt, q[i], delay_us );
+
+    workers = soq->soque_threads_stats( qt, NULL, NULL );
+    wstats = malloc( workers * sizeof( SOQUE_WORKER_STATS ) );
+    qstats = malloc( queue_count * sizeof( SOQUE_STATS ) );
+    shares = malloc( queue_count * sizeof( SOQUE_SHARE ) );
+
+    producer_q = q;
+    producer_q_count = queue_count;
+    producer_batch = batch ? batch : 16;
+
+    for( i = 0; i < producers; i++ )
+    {
+#ifdef _WIN32
+        CreateThread( NULL, 0, producer_thread, NULL, 0, NULL );
+#else
+        pthread_t producer;
+        pthread_create( &producer, NULL, producer_thread, NULL );
+#endif
+    }
+
     SLEEP_1_SEC; // warming
 
     for( ;; )
@@ -165,6 +277,62 @@ int main( int argc, char ** argv )
                 speed_approx / 1000000,
                 speed_approx_change <= speed_approx ? "+" : "",
                 ( speed_approx - speed_approx_change ) / 1000000 );
+
+        {
+            unsigned long long parked_us = 0, retries = 0, enter_fails = 0, yields = 0;
+            unsigned in_proc = 0, processed = 0;
+            unsigned w;
+
+            soq->soque_threads_stats( qt, wstats, qstats );
+
+            for( w = 0; w < workers; w++ )
+                parked_us += wstats[w].parked_us;
+
+            for( i = 0; i < queue_count; i++ )
+            {
+                retries += qstats[i].proc_retries;
+                enter_fails += qstats[i].enter_fails;
+                yields += qstats[i].push_yields + qstats[i].pop_yields;
+                in_proc += qstats[i].in_proc;
+                processed += qstats[i].processed;
+            }
+
+            printf( "Stats:  parked %llu ms   proc retries %llu   enter fails %llu   yields %llu   in proc %u   processed %u\n",
+                    parked_us / 1000, retries, enter_fails, yields, in_proc, processed );
+
+            // per mille of the pool's proc work
+            soq->soque_threads_shares( qt, shares );
+            printf( "Share: " );
+
+            for( i = 0; i < queue_count && i < 8; i++ )
+                printf( "  q%d %u.%u%%", i, shares[i].share / 10, shares[i].share % 10 );
+
+            printf( "\n" );
+        }
+
+        // libsoque built with make DEFS=-DSOQUE_LATENCY
+        if( soq->soque_latency( q[0], SOQUE_LATENCY_TOTAL, latency, 1 ) )
+        {
+            unsigned long long total = 0, seen = 0, p50 = 0, p99 = 0;
+            unsigned b;
+
+            for( b = 0; b < SOQUE_LATENCY_BUCKETS; b++ )
+                total += latency[b];
+
+            for( b = 0; b < SOQUE_LATENCY_BUCKETS && total; b++ )
+            {
+                seen += latency[b];
+
+                if( !p50 && seen * 2 >= total )
+                    p50 = soque_latency_floor( b );
+
+                if( !p99 && seen * 100 >= total * 99 )
+                    p99 = soque_latency_floor( b );
+            }
+
+            printf( "Latency:  p50 %llu tsc   p99 %llu tsc   (queue 0)\n", p50, p99 );
+        }
+
         n++;
     }
 }
@@ -9,15 +9,30 @@
 #endif
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include <vector>
+#include <new>
+#include <algorithm>
+#include <mutex>
 
 #ifdef _WIN32
 #include <windows.h>
+#include <psapi.h>
+#pragma comment( lib, "synchronization.lib" )
+#pragma comment( lib, "psapi.lib" )
 #else
 #ifndef __CYGWIN__
 #include <sched.h>
 #include <pthread.h>
 #endif
+#ifdef __linux__
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <linux/futex.h>
+#endif
 #endif
 
 #include "soque.h"
@@ -32,541 +47,3236 @@
 #pragma warning( disable: 4324 ) // structure was padded due to __declspec(align())
 #define CACHELINE_ALIGN( x ) __declspec( align( CACHELINE_SIZE ) ) x
 #define rdtsc() __rdtsc()
+#define cpu_relax() _mm_pause()
+static inline uint32_t ctz64( uint64_t x )
+{
+    unsigned long r;
+#ifdef _M_IX86
+    if( _BitScanForward( &r, (uint32_t)x ) )
+        return r;
+    _BitScanForward( &r, (uint32_t)( x >> 32 ) );
+    return r + 32;
+#else
+    _BitScanForward64( &r, x );
+    return r;
+#endif
+}
+static inline uint32_t popcnt64( uint64_t x )
+{
+#ifdef _M_IX86
+    return __popcnt( (uint32_t)x ) + __popcnt( (uint32_t)( x >> 32 ) );
+#else
+    return (uint32_t)__popcnt64( x );
+#endif
+}
 #else
 #define CACHELINE_ALIGN( x ) x __attribute__ ( ( aligned( CACHELINE_SIZE ) ) )
+#if defined( __aarch64__ )
+static inline uint64_t rdtsc()
+{
+    uint64_t t;
+    __asm__ __volatile__( "mrs %0, cntvct_el0" : "=r"( t ) );
+    return t;
+}
+#define cpu_relax() __asm__ __volatile__( "yield" )
+#else
 #define rdtsc() __builtin_ia32_rdtsc()
+#define cpu_relax() __builtin_ia32_pause()
+#endif
+#define ctz64( x ) (uint32_t)__builtin_ctzll( x )
+#define popcnt64( x ) (uint32_t)__builtin_popcountll( x )
 #endif
 
-static const uint32_t SOQUE_MAX_THREADS = std::thread::hardware_concurrency();
+// park: sleep while word == value (or timeout), unpark: wake all sleepers on word
+static void soque_park( std::atomic<uint32_t> & word, uint32_t value, uint32_t timeout_ms )
+{
+#if defined( __linux__ )
+    struct timespec ts = { (time_t)( timeout_ms / 1000 ), (long)( timeout_ms % 1000 ) * 1000000 };
+    syscall( SYS_futex, (uint32_t *)&word, FUTEX_WAIT_PRIVATE, value, &ts, NULL, 0 );
+#elif defined( _WIN32 )
+    WaitOnAddress( &word, &value, sizeof( value ), timeout_ms );
+#else
+    if( word == value )
+        std::this_thread::sleep_for( std::chrono::milliseconds( timeout_ms < 1 ? timeout_ms : 1 ) );
+#endif
+}
 
-struct SOQUE
+static void soque_unpark( std::atomic<uint32_t> & word )
 {
-    enum
-    {
-        SOQUE_MARKER_EMPTY = 0,
-        SOQUE_MARKER_PROCESSED = 1,
-        SOQUE_MARKER_FILLED = 2,
-    };
+#if defined( __linux__ )
+    syscall( SYS_futex, (uint32_t *)&word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0 );
+#elif defined( _WIN32 )
+    WakeByAddressAll( &word );
+#else
+    (void)word;
+#endif
+}
 
-    void open( uint32_t size, void * arg, soque_push_cb push, soque_proc_cb proc, soque_pop_cb pop );
-    uint32_t push( uint32_t push_count );
-    SOQUE_BATCH proc_get( uint32_t batch );
-    void proc_done( SOQUE_BATCH );
-    uint32_t pop( uint32_t pop_count );
-    uint8_t pp_enter();
-    void pp_leave();
-    void close();
+#define SOQUE_PARK_SPINS 1024
+#define SOQUE_SCALE_BAND 5 // utilization hysteresis, percent
+#define SOQUE_RESIZE_GROW 3 // orchestra rounds a queue stays 3/4 full before its ring doubles
+#define SOQUE_RESIZE_SHRINK 50 // rounds under 1/8 full before it halves
 
-    CACHELINE_ALIGN( std::atomic_bool soque_pp_guard );
-    CACHELINE_ALIGN( uint32_t q_push );
-    CACHELINE_ALIGN( std::atomic<uint32_t> q_proc_run );
-    CACHELINE_ALIGN( uint32_t q_proc );
-    CACHELINE_ALIGN( uint32_t q_pop );
-    CACHELINE_ALIGN( uint32_t q_size );
-    void * cb_arg;
-    soque_push_cb push_cb;
-    soque_proc_cb proc_cb;
-    soque_pop_cb pop_cb;
-    void * original_alloc;
-    CACHELINE_ALIGN( uint8_t markers[0] );
+static void soque_event_signal( int fd )
+{
+#ifdef __linux__
+    uint64_t one = 1;
+    ssize_t r = write( fd, &one, sizeof( one ) );
+    (void)r;
+#else
+    (void)fd;
+#endif
+}
+
+// markers: 1 bit per slot, set = processed
+#define SOQUE_MARKER_BITS 64
+#define SOQUE_MARKER_WORDS( size ) ( ( (size) + SOQUE_MARKER_BITS - 1 ) / SOQUE_MARKER_BITS )
+
+static inline uint64_t soque_marker_mask( uint32_t bit, uint32_t count )
+{
+    return ( count == SOQUE_MARKER_BITS ? ~(uint64_t)0 : ( ( (uint64_t)1 << count ) - 1 ) ) << bit;
+}
+
+// soque_open_stages: stage count - 1 in the flags, 0 = a plain queue
+#define SOQUE_FLAG_STAGES_SHIFT 16
+#define SOQUE_FLAG_STAGES_MASK 0x000F0000
+
+// SOQUE_FLAG_RANGES: markers area is a completion table, count of a done batch at its first slot
+// SOQUE_FLAG_FLOWS: markers area is processed bitmap, released bitmap, then flow key per slot
+// stages: a done bitmap per stage, the last one is the processed bitmap
+static inline size_t soque_markers_size( uint32_t size, uint32_t flags )
+{
+    if( flags & SOQUE_FLAG_RANGES )
+        return sizeof( uint32_t ) * size;
+
+    if( flags & SOQUE_FLAG_FLOWS )
+        return sizeof( uint64_t ) * SOQUE_MARKER_WORDS( size ) * 2 + sizeof( uint32_t ) * size;
+
+    return sizeof( uint64_t ) * SOQUE_MARKER_WORDS( size ) * ( ( ( flags & SOQUE_FLAG_STAGES_MASK ) >> SOQUE_FLAG_STAGES_SHIFT ) + 1 );
+}
+
+// SOQUE_LATENCY: tsc stamps per slot after the markers area, log-linear histograms filled by the pop owner
+#ifdef SOQUE_LATENCY
+struct SOQUE_STAMP
+{
+    uint64_t push;
+    uint64_t proc;
+    uint64_t done;
 };
 
-void SOQUE::open( uint32_t size, void * arg, soque_push_cb push, soque_proc_cb proc, soque_pop_cb pop )
+static inline size_t soque_stamps_offset( uint32_t size, uint32_t flags )
 {
-    memset( this, 0, sizeof( SOQUE ) + sizeof( uint8_t ) * size );
-    q_size = size;
-    cb_arg = arg;
-    push_cb = push;
-    proc_cb = proc;
-    pop_cb = pop;
+    return ( soque_markers_size( size, flags ) + sizeof( uint64_t ) - 1 ) & ~( sizeof( uint64_t ) - 1 );
 }
 
-void SOQUE::close()
+static inline uint32_t soque_latency_bucket( uint64_t v )
 {
+    uint32_t e;
+
+    if( v < ( 1 << SOQUE_LATENCY_SUB_BITS ) )
+        return (uint32_t)v;
 
+#ifdef _WIN32
+    unsigned long r;
+#ifdef _M_IX86
+    if( _BitScanReverse( &r, (uint32_t)( v >> 32 ) ) )
+        r += 32;
+    else
+        _BitScanReverse( &r, (uint32_t)v );
+#else
+    _BitScanReverse64( &r, v );
+#endif
+    e = r;
+#else
+    e = 63 - (uint32_t)__builtin_clzll( v );
+#endif
+
+    return ( ( e - SOQUE_LATENCY_SUB_BITS + 1 ) << SOQUE_LATENCY_SUB_BITS ) + (uint32_t)( ( v >> ( e - SOQUE_LATENCY_SUB_BITS ) ) & ( ( 1 << SOQUE_LATENCY_SUB_BITS ) - 1 ) );
 }
 
-uint8_t SOQUE::pp_enter()
+static inline uint64_t soque_tsc_since( uint64_t now, uint64_t then )
 {
-    if( soque_pp_guard == false )
-    {
-        bool f = false;
-        if( soque_pp_guard.compare_exchange_weak( f, true ) )
-            return 1;
-    }
+    return now > then ? now - then : 0;
+}
+#endif
 
-    return 0;
+// markers area of a ring: markers, SOQUE_LATENCY stamps, then slots from a cache line
+static inline size_t soque_slots_offset( uint32_t size, uint32_t flags )
+{
+#ifdef SOQUE_LATENCY
+    size_t offset = soque_stamps_offset( size, flags ) + sizeof( SOQUE_STAMP ) * size;
+#else
+    size_t offset = soque_markers_size( size, flags );
+#endif
+
+    return ( offset + CACHELINE_SIZE - 1 ) & ~(size_t)( CACHELINE_SIZE - 1 );
 }
 
-void SOQUE::pp_leave()
+static inline size_t soque_area_size( uint32_t size, uint32_t flags, uint32_t stride )
 {
-    soque_pp_guard = false;
+    return soque_slots_offset( size, flags ) + (size_t)stride * size;
 }
 
-uint32_t SOQUE::push( uint32_t push_count )
+// q_push_run / q_proc_run count modulo 2^31 (ring sizes divide it), the top bit freezes them
+// while a resize waits for the queue to drain
+#define SOQUE_RUN_MASK 0x7FFFFFFF
+#define SOQUE_RUN_FROZEN 0x80000000
+
+// SOQUE_FLAG_FLOWS: pop_get looks this far past q_pop for early releases,
+// keys of flows with an unreleased earlier slot go to a bloom filter of this many bits
+#define SOQUE_FLOW_SCAN 1024
+#define SOQUE_FLOW_BLOOM 1024
+
+static inline uint32_t soque_flow_hash( uint32_t key )
 {
-    uint32_t push_here;
-    uint32_t push_next;
-    uint32_t push_max;
+    return ( key * 2654435761u ) >> ( 32 - 10 ); // log2( SOQUE_FLOW_BLOOM )
+}
 
-    push_here = q_push;
-    push_max = q_pop;
+// stage k > 0 claims from run up to the head of stage k - 1, stage 0 claims by q_proc_run from q_push;
+// head of stage k < last is advanced by a claimer of stage k + 1 holding guard, head of the last stage is q_proc
+struct SOQUE_STAGE
+{
+    CACHELINE_ALIGN( std::atomic<uint32_t> run );
+    CACHELINE_ALIGN( std::atomic<uint32_t> head );
+    std::atomic_bool guard;
+    soque_proc_cb proc_cb;
+};
 
-    if( push_max > push_here )
-        push_max = push_max - push_here - 1;
-    else
-        push_max = q_size + push_max - push_here - 1;
+// soque_link: popped slots move on to the slots of a downstream queue
+struct SOQUE_LINK
+{
+    std::vector<struct SOQUE *> to;
+    soque_route_cb route;
+};
+
+struct SOQUE
+{
+    void open( uint32_t size, uint32_t flags, uint32_t stride, void * arg, soque_push_cb push, soque_proc_cb proc, soque_pop_cb pop, soque_pop_batch_cb pop_batch );
+    uint32_t push( uint32_t push_count );
+    SOQUE_BATCH push_reserve( uint32_t push_count );
+    void push_commit( SOQUE_BATCH );
+    SOQUE_BATCH proc_get( uint32_t batch, uint32_t * retries );
+    SOQUE_BATCH stage_get( uint32_t stage, uint32_t batch, uint32_t * retries );
+    void stage_done( uint32_t stage, SOQUE_BATCH );
+    uint32_t stage_retire( uint32_t stage );
+    uint8_t stages_enter();
+    void stages_leave( uint32_t count );
+    uint32_t pop( uint32_t pop_count );
+    SOQUE_BATCH pop_get( uint32_t batch );
+    void pop_done( SOQUE_BATCH );
+    uint32_t proc_retire();
+    uint32_t proc_backlog();
+    void stats( SOQUE_STATS * st );
+#ifdef SOQUE_LATENCY
+    void latency_stamp( uint32_t i, uint32_t c, size_t field );
+    void latency_pop( uint32_t i, uint32_t c );
+#endif
+    int event_fd( uint32_t event, uint32_t watermark );
+    uint8_t resizable( uint32_t size );
+    uint8_t resize( uint32_t size );
+    void resize_switch();
+    uint32_t used();
+    uint32_t link_move( uint32_t pop_count );
+    uint8_t pp_enter();
+    void pp_leave();
+    uint8_t pop_enter();
+    void pop_leave();
+    uint8_t push_enter();
+    void push_leave();
+    void close();
 
-    if( push_max == 0 || push_count == 0 )
-        return push_max;
+    CACHELINE_ALIGN( std::atomic_bool soque_pop_guard );
+    CACHELINE_ALIGN( std::atomic_bool soque_push_guard );
+    CACHELINE_ALIGN( std::atomic_bool pop_armed );
+    CACHELINE_ALIGN( std::atomic_bool push_armed );
+    CACHELINE_ALIGN( std::atomic<uint32_t> q_push_run );
+    CACHELINE_ALIGN( std::atomic<uint32_t> q_push );
+    CACHELINE_ALIGN( std::atomic<uint32_t> q_proc_run );
+    CACHELINE_ALIGN( std::atomic<uint32_t> q_proc );
+    CACHELINE_ALIGN( std::atomic<uint32_t> q_pop );
+    CACHELINE_ALIGN( std::atomic<uint32_t> q_size );
+    std::atomic<uint32_t> q_resize; // pending ring size, 0 = none
+    std::atomic<uint32_t> q_epoch; // odd while resize_switch swaps the ring
+    std::atomic<uint64_t> * markers; // inline_markers, or an area of its own while the ring is larger than q_inline
+    uint8_t * slots; // slot i at slots + i * q_stride in the markers area, NULL = none
+    uint32_t q_stride;
+    uint32_t q_flags;
+    void * cb_arg;
+    soque_push_cb push_cb;
+    soque_proc_cb proc_cb;
+    soque_pop_cb pop_cb;
+    soque_pop_batch_cb pop_batch_cb;
+    int pop_fd;
+    int push_fd;
+    uint32_t push_watermark;
+    int32_t q_node;
+    void * original_alloc;
+    size_t original_size; // 0 = malloc
+    uint32_t q_inline; // ring size inline_markers fit
+    void * markers_alloc;
+    size_t markers_size; // 0 = malloc
+    void * retired_alloc; // previous markers area, a racing stats may still read it
+    size_t retired_size;
+    SOQUE_STAGE stages[SOQUE_STAGES_MAX];
+    SOQUE_LINK * link; // downstream of the pop side, NULL = pop_cb or the caller pops
+#ifdef SOQUE_LATENCY
+    std::atomic_bool latency_reset;
+    CACHELINE_ALIGN( uint64_t latency[SOQUE_LATENCY_KINDS][SOQUE_LATENCY_BUCKETS] );
+#endif
+    CACHELINE_ALIGN( std::atomic<uint64_t> inline_markers[0] );
 
-    if( push_count > push_max )
-        push_count = push_max;
+    uint32_t ring_size()
+    {
+        return q_size.load( std::memory_order_relaxed );
+    }
 
-    push_next = push_here + push_count;
+    uint32_t stage_last()
+    {
+        return ( q_flags & SOQUE_FLAG_STAGES_MASK ) >> SOQUE_FLAG_STAGES_SHIFT;
+    }
 
-    if( push_next >= q_size )
-        push_next -= q_size;
+    // done bitmap of a stage, stage_last's is the processed one pop walks
+    std::atomic<uint64_t> * stage_bits( uint32_t stage )
+    {
+        return markers + SOQUE_MARKER_WORDS( ring_size() ) * stage;
+    }
 
-#ifdef _DEBUG
-    if( push_count )
+    std::atomic<uint32_t> * ranges()
     {
-        uint32_t i = push_here;
-        uint32_t c = push_count;
+        return (std::atomic<uint32_t> *)markers;
+    }
 
-        for( ;; )
-        {
-            assert( markers[i] == SOQUE_MARKER_EMPTY );
-            markers[i] = SOQUE_MARKER_FILLED;
+    std::atomic<uint64_t> * flow_released()
+    {
+        return markers + SOQUE_MARKER_WORDS( ring_size() );
+    }
 
-            if( --c == 0 )
-                break;
+    uint32_t * flow_keys()
+    {
+        return (uint32_t *)( markers + SOQUE_MARKER_WORDS( ring_size() ) * 2 );
+    }
 
-            if( ++i == q_size )
-                i = 0;
-        }
+#ifdef SOQUE_LATENCY
+    SOQUE_STAMP * stamps()
+    {
+        return (SOQUE_STAMP *)( (uint8_t *)markers + soque_stamps_offset( ring_size(), q_flags ) );
     }
 #endif
 
-    q_push = push_next;
+    static uint32_t markers_chunk( uint32_t size, uint32_t i, uint32_t c )
+    {
+        uint32_t n = SOQUE_MARKER_BITS - i % SOQUE_MARKER_BITS;
 
-    return push_count;
-}
+        if( n > size - i )
+            n = size - i;
 
-SOQUE_BATCH SOQUE::proc_get( uint32_t proc_count )
-{
-    SOQUE_BATCH proc_batch;
-    uint32_t proc_here;
-    uint32_t proc_next;
-    uint32_t proc_max;
-    uint32_t proc_run = q_proc_run;
+        return c < n ? c : n;
+    }
 
-    do
+    // bitmaps over ring slots [i, i + c), set releases the slots, run acquires them
+    uint32_t bits_run( std::atomic<uint64_t> * bits, uint32_t i, uint32_t c )
     {
-        proc_here = proc_run % q_size;
-        proc_max = q_push;
+        uint32_t size = ring_size();
+        uint32_t r = 0;
 
-        if( proc_max == proc_here )
+        while( c )
         {
-            proc_batch.count = 0;
-            return proc_batch;
-        }
+            uint32_t n = markers_chunk( size, i, c );
+            uint64_t todo = ~( bits[i / SOQUE_MARKER_BITS].load( std::memory_order_acquire ) >> ( i % SOQUE_MARKER_BITS ) ) & soque_marker_mask( 0, n );
 
-        if( proc_max > proc_here )
-            proc_max = proc_max - proc_here;
-        else
-            proc_max = q_size + proc_max - proc_here;
+            if( todo )
+                return r + ctz64( todo );
 
-        if( proc_count > proc_max )
-            proc_count = proc_max;
+            r += n;
+            c -= n;
+            if( ( i += n ) == size )
+                i = 0;
+        }
 
-        proc_next = proc_run + proc_count;
+        return r;
     }
-    while( !q_proc_run.compare_exchange_weak( proc_run, proc_next ) );
 
-    proc_here = proc_run % q_size;
-    proc_batch.index = proc_here;
-    proc_batch.count = proc_count;
-    
-#ifdef _DEBUG
-    if( proc_count )
+    // by the ring size the caller read, see stats
+    uint32_t bits_count( std::atomic<uint64_t> * bits, uint32_t size, uint32_t i, uint32_t c )
     {
-        uint32_t i = proc_here;
-        uint32_t c = proc_count;
+        uint32_t r = 0;
 
-        for( ;; )
+        while( c )
         {
-            assert( markers[i] == SOQUE_MARKER_FILLED );
+            uint32_t n = markers_chunk( size, i, c );
 
-            if( --c == 0 )
-                break;
+            r += popcnt64( ( bits[i / SOQUE_MARKER_BITS].load( std::memory_order_relaxed ) >> ( i % SOQUE_MARKER_BITS ) ) & soque_marker_mask( 0, n ) );
 
-            if( ++i == q_size )
+            c -= n;
+            if( ( i += n ) == size )
                 i = 0;
         }
-    }
-#endif
 
-    return proc_batch;
-}
+        return r;
+    }
 
-void SOQUE::proc_done( SOQUE_BATCH proc_batch )
-{
-    if( proc_batch.count )
+    void bits_set( std::atomic<uint64_t> * bits, uint32_t i, uint32_t c )
     {
-        uint32_t i = proc_batch.index;
-        uint32_t c = proc_batch.count;
+        uint32_t size = ring_size();
 
-        for( ;; )
+        while( c )
         {
+            uint32_t n = markers_chunk( size, i, c );
+            uint64_t mask = soque_marker_mask( i % SOQUE_MARKER_BITS, n );
 #ifdef _DEBUG
-            assert( markers[i] == SOQUE_MARKER_FILLED );
+            assert( ( bits[i / SOQUE_MARKER_BITS].fetch_or( mask, std::memory_order_release ) & mask ) == 0 );
+#else
+            bits[i / SOQUE_MARKER_BITS].fetch_or( mask, std::memory_order_release );
 #endif
-            markers[i] = SOQUE_MARKER_PROCESSED;
-
-            if( --c == 0 )
-                break;
 
-            if( ++i == q_size )
+            c -= n;
+            if( ( i += n ) == size )
                 i = 0;
         }
     }
-}
-
-uint32_t SOQUE::pop( uint32_t pop_count )
-{
-    uint32_t pop_here;
-    uint32_t pop_next;
-    uint32_t pop_max;
 
-    // finish q_proc
+    void bits_clear( std::atomic<uint64_t> * bits, uint32_t i, uint32_t c )
     {
-        uint32_t proc_now = q_proc;
-        uint32_t proc_next = proc_now;
-        uint32_t push_max = q_push;
+        uint32_t size = ring_size();
 
-        for( ;; )
+        while( c )
         {
-            if( proc_next == push_max )
-                break;
-
-            if( markers[proc_next] != SOQUE_MARKER_PROCESSED )
-                break;
+            uint32_t n = markers_chunk( size, i, c );
+            uint64_t mask = soque_marker_mask( i % SOQUE_MARKER_BITS, n );
+#ifdef _DEBUG
+            assert( ( bits[i / SOQUE_MARKER_BITS].fetch_and( ~mask, std::memory_order_relaxed ) & mask ) == mask );
+#else
+            bits[i / SOQUE_MARKER_BITS].fetch_and( ~mask, std::memory_order_relaxed );
+#endif
 
-            if( ++proc_next == q_size )
-                proc_next = 0;
+            c -= n;
+            if( ( i += n ) == size )
+                i = 0;
         }
+    }
 
-        if( proc_next != proc_now )
-            q_proc = proc_next;
-
-        pop_max = proc_next;
-    }    
-
-    pop_here = q_pop;    
-
-    if( pop_max == pop_here )
-        return 0;
-
-    if( pop_max > pop_here )
-        pop_max = pop_max - pop_here;
-    else
-        pop_max = q_size + pop_max - pop_here;
-
-    if( pop_count == 0 )
-        return pop_max;
-
-    if( pop_count > pop_max )
-        pop_count = pop_max;
-
-    pop_next = pop_here + pop_count;
-
-    if( pop_next >= q_size )
-        pop_next -= q_size;
-
-    if( pop_count )
+#ifdef _DEBUG
+    uint8_t bits_none( std::atomic<uint64_t> * bits, uint32_t i, uint32_t c )
     {
-        uint32_t i = pop_here;
-        uint32_t c = pop_count;
+        uint32_t size = ring_size();
 
-        for( ;; )
+        while( c )
         {
-#ifdef _DEBUG
-            assert( markers[i] == SOQUE_MARKER_PROCESSED );
-#endif
-            markers[i] = SOQUE_MARKER_EMPTY;
+            uint32_t n = markers_chunk( size, i, c );
 
-            if( --c == 0 )
-                break;
+            if( bits[i / SOQUE_MARKER_BITS].load( std::memory_order_relaxed ) & soque_marker_mask( i % SOQUE_MARKER_BITS, n ) )
+                return 0;
 
-            if( ++i == q_size )
+            c -= n;
+            if( ( i += n ) == size )
                 i = 0;
         }
+
+        return 1;
     }
+#endif
+};
 
-    q_pop = pop_next;
+void SOQUE::open( uint32_t size, uint32_t flags, uint32_t stride, void * arg, soque_push_cb push, soque_proc_cb proc, soque_pop_cb pop, soque_pop_batch_cb pop_batch )
+{
+    memset( (void *)this, 0, sizeof( SOQUE ) + soque_area_size( size, flags, stride ) );
+    q_size.store( size, std::memory_order_relaxed );
+    q_inline = size;
+    markers = inline_markers;
+    q_flags = flags & ~SOQUE_FLAG_NODE_MASK;
+    q_stride = stride;
+    slots = stride ? (uint8_t *)inline_markers + soque_slots_offset( size, q_flags ) : NULL;
+    q_node = (int32_t)( flags >> SOQUE_FLAG_NODE_SHIFT ) - 1;
+    cb_arg = arg;
+    push_cb = push;
+    proc_cb = proc;
+    stages[0].proc_cb = proc;
+    pop_cb = pop;
+    pop_batch_cb = pop_batch;
+    pop_fd = -1;
+    push_fd = -1;
+}
 
-    return pop_count;
+void SOQUE::close()
+{
+    delete link;
+
+#ifdef __linux__
+    if( pop_fd >= 0 )
+        ::close( pop_fd );
+    if( push_fd >= 0 )
+        ::close( push_fd );
+#endif
 }
 
-SOQUE_HANDLE SOQUE_CALL soque_open( uint32_t size, void * cb_arg, soque_push_cb push_cb, soque_proc_cb proc_cb, soque_pop_cb pop_cb )
+int SOQUE::event_fd( uint32_t event, uint32_t watermark )
 {
-    if( ( ( (uint32_t)-1 ) % size ) != size - 1 )
-        return NULL;
+#ifdef __linux__
+    int * fd = event == SOQUE_EVENT_POP ? &pop_fd : event == SOQUE_EVENT_PUSH ? &push_fd : NULL;
 
-    void * mem = malloc( sizeof( SOQUE ) + sizeof( uint8_t ) * size + CACHELINE_SIZE );
+    if( !fd )
+        return -1;
 
-    if( !mem )
-        return NULL;
+    if( *fd < 0 )
+        *fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
 
-    SOQUE_HANDLE sh = CACHELINE_SHIFT( mem, SOQUE_HANDLE );
-    sh->open( size, cb_arg, push_cb, proc_cb, pop_cb );
-    sh->original_alloc = mem;
+    if( event == SOQUE_EVENT_PUSH )
+        push_watermark = watermark ? watermark : 1;
 
-    return sh;
+    return *fd;
+#else
+    (void)event;
+    (void)watermark;
+    return -1;
+#endif
 }
 
-uint8_t SOQUE_CALL soque_pp_enter( SOQUE_HANDLE sh )
+// guard owner takes q_proc, q_pop and the markers from the previous owner
+static inline uint8_t soque_guard_enter( std::atomic_bool & guard )
 {
-    return sh->pp_enter();
+    if( guard.load( std::memory_order_relaxed ) == false )
+    {
+        bool f = false;
+        if( guard.compare_exchange_weak( f, true, std::memory_order_acquire, std::memory_order_relaxed ) )
+            return 1;
+    }
+
+    return 0;
 }
 
-void SOQUE_CALL soque_pp_leave( SOQUE_HANDLE sh )
+uint8_t SOQUE::pop_enter()
 {
-    sh->pp_leave();
+    return soque_guard_enter( soque_pop_guard );
 }
 
-uint32_t SOQUE_CALL soque_push( SOQUE_HANDLE sh, uint32_t push_count )
+void SOQUE::pop_leave()
 {
-    return sh->push( push_count );
+    soque_pop_guard.store( false, std::memory_order_release );
 }
 
-SOQUE_BATCH SOQUE_CALL soque_proc_get( SOQUE_HANDLE sh, uint32_t batch )
+uint8_t SOQUE::push_enter()
 {
-    return sh->proc_get( batch );
+    return soque_guard_enter( soque_push_guard );
 }
 
-void SOQUE_CALL soque_proc_done( SOQUE_HANDLE sh, SOQUE_BATCH proc_batch )
+void SOQUE::push_leave()
 {
-    sh->proc_done( proc_batch );
+    soque_push_guard.store( false, std::memory_order_release );
 }
 
-uint32_t SOQUE_CALL soque_pop( SOQUE_HANDLE sh, uint32_t pop_count )
+uint8_t SOQUE::pp_enter()
 {
-    return sh->pop( pop_count );
+    if( !pop_enter() )
+        return 0;
+
+    if( !push_enter() )
+    {
+        pop_leave();
+        return 0;
+    }
+
+    return 1;
 }
 
-void SOQUE_CALL soque_close( SOQUE_HANDLE sh )
+void SOQUE::pp_leave()
 {
-    void * mem = sh->original_alloc;
-    sh->close();
-    free( mem );
+    push_leave();
+    pop_leave();
 }
 
-struct SOQUE_THREADS
+SOQUE_BATCH SOQUE::push_reserve( uint32_t push_count )
 {
-    std::vector<SOQUE_HANDLE> soques_handles;
-    uint8_t shutdown;
-    uint32_t threads_count;
-    uint32_t soques_count;
-    uint32_t workers_count;
-    uint32_t batch;
-    uint32_t threshold;
-    uint32_t reaction;
-    uint32_t lrt;
-    std::atomic<uint32_t> threads_sync;
-    std::vector<std::thread> threads;
-    std::vector<uint32_t> t_proc_meters;
-    std::vector<uint32_t> q_lrts;
+    SOQUE_BATCH push_batch;
+    uint32_t push_here;
+    uint32_t push_max;
+    uint32_t push_run = q_push_run.load( std::memory_order_acquire );
+
+    // q_push_run acquire keeps q_pop at least as new as what the reserver of push_run saw,
+    // q_pop acquire hands the slots back from the pop side
+    for( ;; )
+    {
+        push_here = push_run % ring_size();
+        push_max = q_pop.load( std::memory_order_acquire );
+
+        if( push_max > push_here )
+            push_max = push_max - push_here - 1;
+        else
+            push_max = ring_size() + push_max - push_here - 1;
+
+        // resize pending, no room until the switch
+        if( push_run & SOQUE_RUN_FROZEN )
+            push_max = 0;
+
+        push_batch.index = push_here;
+
+        // arm push event, then look at q_pop and q_push_run once more, the fence pairs with pop and resize_switch
+        if( push_fd >= 0 && push_max < push_watermark && !push_armed.load( std::memory_order_relaxed ) )
+        {
+            push_armed.store( true, std::memory_order_relaxed );
+            std::atomic_thread_fence( std::memory_order_seq_cst );
+            push_run = q_push_run.load( std::memory_order_acquire );
+            continue;
+        }
+
+        if( push_fd >= 0 && push_max >= push_watermark && push_armed.load( std::memory_order_relaxed ) )
+            push_armed.store( false, std::memory_order_relaxed );
+
+        if( push_max == 0 || push_count == 0 )
+        {
+            push_batch.count = push_max;
+            return push_batch;
+        }
+
+        push_batch.count = push_count > push_max ? push_max : push_count;
+
+        if( q_push_run.compare_exchange_weak( push_run, ( push_run + push_batch.count ) & SOQUE_RUN_MASK, std::memory_order_acq_rel, std::memory_order_acquire ) )
+            break;
+    }
+
+#ifdef _DEBUG
+    if( !( q_flags & SOQUE_FLAG_RANGES ) )
+        assert( bits_none( markers, push_here, push_batch.count ) );
+#endif
+
+    return push_batch;
+}
+
+void SOQUE::push_commit( SOQUE_BATCH push_batch )
+{
+    uint32_t push_next;
+
+    if( push_batch.count == 0 )
+        return;
+
+    push_next = push_batch.index + push_batch.count;
+
+    if( push_next >= ring_size() )
+        push_next -= ring_size();
+
+#ifdef SOQUE_LATENCY
+    latency_stamp( push_batch.index, push_batch.count, offsetof( SOQUE_STAMP, push ) );
+#endif
+
+    // publish in reservation order, acquire chains the earlier producers' slots into ours
+    while( q_push.load( std::memory_order_acquire ) != push_batch.index )
+        std::this_thread::yield();
+
+    q_push.store( push_next, std::memory_order_release );
+}
+
+uint32_t SOQUE::push( uint32_t push_count )
+{
+    SOQUE_BATCH push_batch = push_reserve( push_count );
+
+    if( push_count == 0 )
+        return push_batch.count;
+
+    push_commit( push_batch );
+
+    return push_batch.count;
+}
+
+SOQUE_BATCH SOQUE::proc_get( uint32_t proc_count, uint32_t * retries )
+{
+    SOQUE_BATCH proc_batch;
+    uint32_t proc_here;
+    uint32_t proc_next;
+    uint32_t proc_max;
+    uint32_t proc_run = q_proc_run.load( std::memory_order_acquire );
+    uint32_t tries = 0;
+
+    // as in push_reserve: q_push is at least what the claimer of proc_run saw, and acquires the slots
+    do
+    {
+        proc_here = proc_run % ring_size();
+        proc_max = q_push.load( std::memory_order_acquire );
+
+        if( proc_max == proc_here || ( proc_run & SOQUE_RUN_FROZEN ) )
+        {
+            proc_batch.count = 0;
+
+            if( retries )
+                *retries = tries;
+
+            return proc_batch;
+        }
+
+        tries++;
+
+        if( proc_max > proc_here )
+            proc_max = proc_max - proc_here;
+        else
+            proc_max = ring_size() + proc_max - proc_here;
+
+        if( proc_count > proc_max )
+            proc_count = proc_max;
+
+        proc_next = ( proc_run + proc_count ) & SOQUE_RUN_MASK;
+    }
+    while( !q_proc_run.compare_exchange_weak( proc_run, proc_next, std::memory_order_acq_rel, std::memory_order_acquire ) );
+
+    proc_here = proc_run % ring_size();
+    proc_batch.index = proc_here;
+    proc_batch.count = proc_count;
+
+    if( retries )
+        *retries = tries - 1;
+
+#ifdef SOQUE_LATENCY
+    latency_stamp( proc_here, proc_count, offsetof( SOQUE_STAMP, proc ) );
+#endif
+
+#ifdef _DEBUG
+    if( !( q_flags & SOQUE_FLAG_RANGES ) )
+        assert( bits_none( markers, proc_here, proc_count ) );
+#endif
+
+    return proc_batch;
+}
+
+// stage > 0 claims what stage - 1 is done with, as proc_get does what is pushed
+SOQUE_BATCH SOQUE::stage_get( uint32_t stage, uint32_t proc_count, uint32_t * retries )
+{
+    SOQUE_BATCH proc_batch;
+    SOQUE_STAGE * st = &stages[stage];
+    uint32_t proc_here;
+    uint32_t proc_next;
+    uint32_t proc_max;
+    uint32_t proc_run;
+    uint32_t tries = 0;
+
+    if( stage == 0 )
+        return proc_get( proc_count, retries );
+
+    proc_run = st->run.load( std::memory_order_acquire );
+
+    do
+    {
+        proc_here = proc_run % ring_size();
+        proc_max = stage_retire( stage - 1 );
+
+        if( proc_max == proc_here || ( proc_run & SOQUE_RUN_FROZEN ) )
+        {
+            proc_batch.count = 0;
+
+            if( retries )
+                *retries = tries;
+
+            return proc_batch;
+        }
+
+        tries++;
+
+        if( proc_max > proc_here )
+            proc_max = proc_max - proc_here;
+        else
+            proc_max = ring_size() + proc_max - proc_here;
+
+        if( proc_count > proc_max )
+            proc_count = proc_max;
+
+        proc_next = ( proc_run + proc_count ) & SOQUE_RUN_MASK;
+    }
+    while( !st->run.compare_exchange_weak( proc_run, proc_next, std::memory_order_acq_rel, std::memory_order_acquire ) );
+
+    proc_batch.index = proc_run % ring_size();
+    proc_batch.count = proc_count;
+
+    if( retries )
+        *retries = tries - 1;
+
+#ifdef _DEBUG
+    assert( bits_none( stage_bits( stage ), proc_batch.index, proc_count ) );
+#endif
+
+    return proc_batch;
+}
+
+// advance the head of a stage before the last over its done prefix, its bits are cleared on the way;
+// guard busy: another claimer of the next stage is at it, its head is as good
+uint32_t SOQUE::stage_retire( uint32_t stage )
+{
+    SOQUE_STAGE * st = &stages[stage];
+    std::atomic<uint64_t> * bits;
+    uint32_t head;
+    uint32_t push_max;
+    uint32_t n;
+
+    if( !soque_guard_enter( st->guard ) )
+        return st->head.load( std::memory_order_acquire );
+
+    bits = stage_bits( stage );
+    head = st->head.load( std::memory_order_relaxed );
+    push_max = q_push.load( std::memory_order_acquire );
+    n = bits_run( bits, head, push_max >= head ? push_max - head : ring_size() + push_max - head );
+
+    if( n )
+    {
+        bits_clear( bits, head, n );
+
+        if( ( head += n ) >= ring_size() )
+            head -= ring_size();
+
+        st->head.store( head, std::memory_order_release );
+    }
+
+    st->guard.store( false, std::memory_order_release );
+
+    return head;
+}
+
+// head guards of the stages before the last, for resize_switch
+uint8_t SOQUE::stages_enter()
+{
+    for( uint32_t k = 0; k < stage_last(); k++ )
+    {
+        if( !soque_guard_enter( stages[k].guard ) )
+        {
+            stages_leave( k );
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+void SOQUE::stages_leave( uint32_t count )
+{
+    for( uint32_t k = 0; k < count; k++ )
+        stages[k].guard.store( false, std::memory_order_release );
+}
+
+// pushed and not claimed by the first stage, plus what waits between stages
+uint32_t SOQUE::proc_backlog()
+{
+    uint32_t proc_here = q_proc_run.load( std::memory_order_acquire ) % ring_size();
+    uint32_t push_max = q_push.load( std::memory_order_relaxed );
+    uint32_t backlog = push_max >= proc_here ? push_max - proc_here : ring_size() + push_max - proc_here;
+
+    for( uint32_t k = 1; k <= stage_last(); k++ )
+    {
+        proc_here = stages[k].run.load( std::memory_order_relaxed ) % ring_size();
+        push_max = stages[k - 1].head.load( std::memory_order_relaxed );
+        backlog += ( push_max + ring_size() - proc_here ) % ring_size();
+    }
+
+    return backlog;
+}
+
+void SOQUE::stage_done( uint32_t stage, SOQUE_BATCH proc_batch )
+{
+    uint32_t i = proc_batch.index;
+    uint32_t c = proc_batch.count;
+
+    // an empty batch holds no slot, nor the ring it came from across a resize
+    if( c == 0 )
+        return;
+
+    // on to the next stage once this one's head passes the batch
+    if( stage != stage_last() )
+    {
+        bits_set( stage_bits( stage ), i, c );
+        return;
+    }
+
+#ifdef SOQUE_LATENCY
+    latency_stamp( i, c, offsetof( SOQUE_STAMP, done ) );
+#endif
+
+    if( q_flags & SOQUE_FLAG_RANGES )
+    {
+#ifdef _DEBUG
+        assert( ranges()[i].load( std::memory_order_relaxed ) == 0 );
+#endif
+        ranges()[i].store( c, std::memory_order_release );
+    }
+    else
+    {
+        bits_set( stage_bits( stage ), i, c );
+    }
+
+    // head of the queue is done, wake armed pop event, the fence pairs with the one in pop;
+    // flows: any slot pop_get scans may start a run past an unfinished head, its flow may still hold it
+    if( pop_fd >= 0 )
+    {
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+
+        if( pop_armed.load( std::memory_order_relaxed ) )
+        {
+            uint32_t head = q_proc.load( std::memory_order_relaxed );
+            uint32_t d = head >= proc_batch.index ? head - proc_batch.index : ring_size() + head - proc_batch.index;
+            uint8_t ready = d < proc_batch.count;
+
+            if( q_flags & SOQUE_FLAG_FLOWS )
+            {
+                head = q_pop.load( std::memory_order_relaxed );
+                ready = ( proc_batch.index >= head ? proc_batch.index - head : ring_size() + proc_batch.index - head ) < SOQUE_FLOW_SCAN;
+            }
+
+            if( ready && pop_armed.exchange( false, std::memory_order_relaxed ) )
+                soque_event_signal( pop_fd );
+        }
+    }
+}
+
+#ifdef SOQUE_LATENCY
+void SOQUE::latency_stamp( uint32_t i, uint32_t c, size_t field )
+{
+    uint64_t now = rdtsc();
+    SOQUE_STAMP * st = stamps();
+
+    for( ; c; c-- )
+    {
+        *(uint64_t *)( (uint8_t *)&st[i] + field ) = now;
+
+        if( ++i == ring_size() )
+            i = 0;
+    }
+}
+
+// pop owner only, so plain increments
+void SOQUE::latency_pop( uint32_t i, uint32_t c )
+{
+    uint64_t now = rdtsc();
+    SOQUE_STAMP * st = stamps();
+
+    if( latency_reset )
+    {
+        memset( latency, 0, sizeof( latency ) );
+        latency_reset = false;
+    }
+
+    for( ; c; c-- )
+    {
+        latency[SOQUE_LATENCY_TOTAL][soque_latency_bucket( soque_tsc_since( now, st[i].push ) )]++;
+        latency[SOQUE_LATENCY_WAIT][soque_latency_bucket( soque_tsc_since( st[i].proc, st[i].push ) )]++;
+        latency[SOQUE_LATENCY_PROC][soque_latency_bucket( soque_tsc_since( st[i].done, st[i].proc ) )]++;
+        latency[SOQUE_LATENCY_ORDER][soque_latency_bucket( soque_tsc_since( now, st[i].done ) )]++;
+
+        if( ++i == ring_size() )
+            i = 0;
+    }
+}
+#endif
+
+// racy snapshot, cursors read from the tail forward so none overtakes the next;
+// markers are walked only if no resize switch ran meanwhile, by the size and area read with the cursors
+void SOQUE::stats( SOQUE_STATS * st )
+{
+    uint32_t epoch = q_epoch.load( std::memory_order_acquire );
+    uint32_t size = ring_size();
+    std::atomic<uint64_t> * m = markers;
+    uint32_t pop_here = q_pop.load( std::memory_order_acquire );
+    uint32_t proc_now = q_proc.load( std::memory_order_acquire );
+    uint32_t proc_here = q_proc_run.load( std::memory_order_acquire ) % size;
+    uint32_t push_max = q_push.load( std::memory_order_acquire );
+    uint32_t push_here = q_push_run.load( std::memory_order_acquire ) % size;
+    uint32_t done = ( proc_now + size - pop_here ) % size;
+    uint32_t claimed = ( proc_here + size - proc_now ) % size;
+
+    std::atomic_thread_fence( std::memory_order_acquire );
+
+    memset( st, 0, sizeof( SOQUE_STATS ) );
+    st->size = size;
+    st->free = size - 1 - ( push_here + size - pop_here ) % size;
+    st->reserved = ( push_here + size - push_max ) % size;
+    st->filled = ( push_max + size - proc_here ) % size;
+
+    if( ( epoch & 1 ) || q_epoch.load( std::memory_order_relaxed ) != epoch )
+    {
+        st->processed = done;
+        st->in_proc = claimed;
+    }
+    else if( q_flags & SOQUE_FLAG_RANGES )
+    {
+        // done batches behind an unfinished one are not reachable
+        std::atomic<uint32_t> * r = (std::atomic<uint32_t> *)m;
+        uint32_t i = proc_now;
+        uint32_t c = claimed;
+
+        while( c )
+        {
+            uint32_t n = r[i].load( std::memory_order_relaxed );
+
+            if( n == 0 || n > c )
+                break;
+
+            done += n;
+            c -= n;
+            i = ( i + n ) % size;
+        }
+
+        st->processed = done;
+        st->in_proc = c;
+    }
+    else
+    {
+        uint32_t ahead = bits_count( m + SOQUE_MARKER_WORDS( size ) * stage_last(), size, proc_now, claimed );
+
+        if( q_flags & SOQUE_FLAG_FLOWS )
+            done -= bits_count( flow_released(), size, pop_here, done );
+
+        st->processed = done + ahead;
+        st->in_proc = claimed - ahead;
+    }
+}
+
+// advance q_proc over the processed prefix, pop owner only
+uint32_t SOQUE::proc_retire()
+{
+    uint32_t proc_now = q_proc.load( std::memory_order_relaxed );
+    uint32_t proc_next = proc_now;
+    uint32_t push_max = q_push.load( std::memory_order_acquire );
+    uint32_t c = push_max >= proc_now ? push_max - proc_now : ring_size() + push_max - proc_now;
+
+    if( q_flags & SOQUE_FLAG_RANGES )
+    {
+        std::atomic<uint32_t> * r = ranges();
+
+        while( c )
+        {
+            uint32_t n = r[proc_next].load( std::memory_order_acquire );
+
+            if( n == 0 )
+                break;
+
+            r[proc_next].store( 0, std::memory_order_relaxed );
+
+            c -= n;
+            if( ( proc_next += n ) >= ring_size() )
+                proc_next -= ring_size();
+        }
+    }
+    else
+    {
+        if( ( proc_next += bits_run( stage_bits( stage_last() ), proc_next, c ) ) >= ring_size() )
+            proc_next -= ring_size();
+    }
+
+    if( proc_next != proc_now )
+        q_proc.store( proc_next, std::memory_order_release );
+
+    return proc_next;
+}
+
+uint32_t SOQUE::pop( uint32_t pop_count )
+{
+    uint32_t pop_here;
+    uint32_t pop_next;
+    uint32_t pop_max;
+
+    pop_max = proc_retire();
+    pop_here = q_pop.load( std::memory_order_relaxed );
+
+    // arm pop event, then retire once more to not miss a racing proc_done
+    if( pop_max == pop_here && pop_fd >= 0 && !pop_armed.load( std::memory_order_relaxed ) )
+    {
+        pop_armed.store( true, std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        pop_max = proc_retire();
+
+        if( pop_max != pop_here )
+            pop_armed.store( false, std::memory_order_relaxed );
+    }
+
+    if( pop_max == pop_here )
+    {
+        // drained, a pending resize takes place now
+        if( q_resize.load( std::memory_order_relaxed ) )
+            resize_switch();
+
+        return 0;
+    }
+
+    if( pop_max > pop_here )
+        pop_max = pop_max - pop_here;
+    else
+        pop_max = ring_size() + pop_max - pop_here;
+
+    if( pop_count == 0 )
+        return pop_max;
+
+    if( pop_count > pop_max )
+        pop_count = pop_max;
+
+    pop_next = pop_here + pop_count;
+
+    if( pop_next >= ring_size() )
+        pop_next -= ring_size();
+
+#ifdef SOQUE_LATENCY
+    if( !( q_flags & SOQUE_FLAG_FLOWS ) )
+        latency_pop( pop_here, pop_count );
+#endif
+
+    if( !( q_flags & SOQUE_FLAG_RANGES ) )
+        bits_clear( stage_bits( stage_last() ), pop_here, pop_count );
+
+    q_pop.store( pop_next, std::memory_order_release );
+
+    // free space crossed the watermark, wake armed push event
+    if( push_fd >= 0 )
+    {
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+
+        if( push_armed.load( std::memory_order_relaxed ) )
+        {
+            uint32_t push_here = q_push_run.load( std::memory_order_relaxed ) % ring_size();
+            uint32_t push_max = pop_next > push_here ? pop_next - push_here - 1 : ring_size() + pop_next - push_here - 1;
+
+            if( push_max >= push_watermark && push_armed.exchange( false, std::memory_order_relaxed ) )
+                soque_event_signal( push_fd );
+        }
+    }
+
+    return pop_count;
+}
+
+SOQUE_BATCH SOQUE::pop_get( uint32_t pop_count )
+{
+    SOQUE_BATCH pop_batch;
+    uint32_t queued = pop( 0 );
+
+    pop_batch.index = q_pop.load( std::memory_order_relaxed );
+    pop_batch.count = 0;
+
+    if( !( q_flags & SOQUE_FLAG_FLOWS ) )
+    {
+        pop_batch.count = queued < pop_count ? queued : pop_count;
+        return pop_batch;
+    }
+
+    // first run of processed slots with no unreleased earlier slot of the same flow
+    {
+        uint64_t blocked[SOQUE_FLOW_BLOOM / 64] = { 0 };
+        std::atomic<uint64_t> * released = flow_released();
+        uint32_t * keys = flow_keys();
+        uint32_t i = q_pop.load( std::memory_order_relaxed );
+        uint32_t push_max = q_push.load( std::memory_order_acquire );
+        uint32_t c = push_max >= i ? push_max - i : ring_size() + push_max - i;
+
+        if( c > SOQUE_FLOW_SCAN )
+            c = SOQUE_FLOW_SCAN;
+
+        for( ; c && pop_count; c-- )
+        {
+            uint64_t bit = (uint64_t)1 << ( i % SOQUE_MARKER_BITS );
+
+            if( released[i / SOQUE_MARKER_BITS].load( std::memory_order_relaxed ) & bit )
+            {
+                if( pop_batch.count )
+                    break;
+            }
+            else
+            {
+                uint32_t h = soque_flow_hash( keys[i] );
+                uint64_t hbit = (uint64_t)1 << ( h % 64 );
+
+                if( ( markers[i / SOQUE_MARKER_BITS].load( std::memory_order_acquire ) & bit ) && !( blocked[h / 64] & hbit ) )
+                {
+                    if( pop_batch.count == 0 )
+                        pop_batch.index = i;
+
+                    if( ++pop_batch.count == pop_count )
+                        break;
+                }
+                else
+                {
+                    if( pop_batch.count )
+                        break;
+
+                    blocked[h / 64] |= hbit;
+                }
+            }
+
+            if( ++i == ring_size() )
+                i = 0;
+        }
+    }
+
+    return pop_batch;
+}
+
+void SOQUE::pop_done( SOQUE_BATCH pop_batch )
+{
+    std::atomic<uint64_t> * released;
+    uint32_t pop_here;
+    uint32_t push_max;
+
+    if( !( q_flags & SOQUE_FLAG_FLOWS ) )
+    {
+#ifdef _DEBUG
+        assert( pop_batch.index == q_pop.load( std::memory_order_relaxed ) );
+#endif
+        pop( pop_batch.count );
+        return;
+    }
+
+#ifdef SOQUE_LATENCY
+    latency_pop( pop_batch.index, pop_batch.count );
+#endif
+
+    // free the released prefix
+    released = flow_released();
+    bits_set( released, pop_batch.index, pop_batch.count );
+
+    pop_here = q_pop.load( std::memory_order_relaxed );
+    push_max = q_push.load( std::memory_order_acquire );
+    pop_batch.count = bits_run( released, pop_here, push_max >= pop_here ? push_max - pop_here : ring_size() + push_max - pop_here );
+
+    if( pop_batch.count )
+    {
+        bits_clear( released, pop_here, pop_batch.count );
+        pop( pop_batch.count );
+    }
+}
+
+// pop owner: hand the processed head over to the downstream queues, a run of slots per destination
+// through push_reserve / push_commit there, each slot copied into a destination slot at least as large;
+// a full destination stops it, so the rest stays queued here and the back pressure reaches this queue's producers
+uint32_t SOQUE::link_move( uint32_t pop_count )
+{
+    uint32_t queued = pop( 0 );
+    uint32_t i = q_pop.load( std::memory_order_relaxed );
+    uint32_t moved = 0;
+    uint32_t next;
+
+    if( pop_count > queued )
+        pop_count = queued;
+
+    if( pop_count == 0 )
+        return 0;
+
+    next = link->route ? link->route( cb_arg, slots + (size_t)i * q_stride ) : 0;
+
+    while( moved < pop_count )
+    {
+        uint32_t to = next;
+        uint32_t run = 1;
+        uint32_t j = i;
+        SOQUE_BATCH push_batch;
+        SOQUE * sh;
+
+        // same destination ahead, the route of the slot after the run is kept for the next one
+        for( ; moved + run < pop_count; run++ )
+        {
+            if( ++j == ring_size() )
+                j = 0;
+
+            next = link->route ? link->route( cb_arg, slots + (size_t)j * q_stride ) : 0;
+
+            if( next != to )
+                break;
+        }
+
+        // routed nowhere: dropped
+        if( to >= link->to.size() )
+        {
+            moved += run;
+            i = ( i + run ) % ring_size();
+            continue;
+        }
+
+        sh = link->to[to];
+        push_batch = sh->push_reserve( run );
+
+        if( push_batch.count == 0 )
+            break;
+
+        for( uint32_t c = 0, d = push_batch.index; c < push_batch.count; c++ )
+        {
+            memcpy( sh->slots + (size_t)d * sh->q_stride, slots + (size_t)i * q_stride, q_stride );
+
+            if( ++i == ring_size() )
+                i = 0;
+
+            if( ++d == sh->ring_size() )
+                d = 0;
+        }
+
+        sh->push_commit( push_batch );
+        moved += push_batch.count;
+
+        if( push_batch.count < run )
+            break;
+    }
+
+    if( moved )
+        pop( moved );
+
+    return moved;
+}
+
+#define SOQUE_MAX_NODES 256
+#define SOQUE_MPOL_PREFERRED 1
+#define SOQUE_MPOL_F_NODE 1
+#define SOQUE_MPOL_F_ADDR 2
+
+#ifdef __linux__
+// default huge page size, 0 = none
+static size_t soque_huge_size()
+{
+    FILE * f = fopen( "/proc/meminfo", "r" );
+    char line[128];
+    unsigned long kb = 0;
+
+    if( !f )
+        return 0;
+
+    while( fgets( line, sizeof( line ), f ) )
+        if( sscanf( line, "Hugepagesize: %lu kB", &kb ) == 1 )
+            break;
+
+    fclose( f );
+    return (size_t)kb * 1024;
+}
+#endif
+
+// queue memory preferring a numa node, on huge pages if asked: reserved ones first, then transparent
+// ones where the kernel has them, then plain pages; *size becomes what to free with, 0 = malloc;
+// SOQUE::open does the first touch, which faults the whole ring in at open
+static void * soque_mem_alloc( size_t * size, int32_t node, uint8_t huge )
+{
+    if( node < 0 && !huge )
+    {
+        void * mem = malloc( *size );
+        *size = 0;
+        return mem;
+    }
+
+#if defined( __linux__ )
+    static const size_t huge_size = soque_huge_size();
+    const uint32_t word_bits = 8 * sizeof( unsigned long );
+    unsigned long nodemask[SOQUE_MAX_NODES / word_bits] = { 0 };
+    void * mem = MAP_FAILED;
+
+    if( huge && huge_size )
+    {
+        *size = ( *size + huge_size - 1 ) & ~( huge_size - 1 );
+        mem = mmap( NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+    }
+
+    if( mem == MAP_FAILED )
+    {
+        mem = mmap( NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+
+        if( mem == MAP_FAILED )
+            return NULL;
+
+        if( huge )
+            madvise( mem, *size, MADV_HUGEPAGE );
+    }
+
+    if( node >= 0 )
+    {
+        nodemask[node / word_bits] = 1UL << ( node % word_bits );
+        syscall( SYS_mbind, mem, *size, SOQUE_MPOL_PREFERRED, nodemask, (unsigned long)SOQUE_MAX_NODES + 1, 0 ); // unknown node keeps the default policy
+    }
+
+    return mem;
+#elif defined( _WIN32 )
+    SIZE_T large = huge ? GetLargePageMinimum() : 0;
+    void * mem = NULL;
+
+    // large pages need SeLockMemoryPrivilege, plain ones do without
+    if( large )
+    {
+        SIZE_T s = ( *size + large - 1 ) & ~( large - 1 );
+
+        mem = node >= 0 ? VirtualAllocExNuma( GetCurrentProcess(), NULL, s, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE, (DWORD)node )
+                        : VirtualAlloc( NULL, s, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE );
+    }
+
+    if( !mem && node >= 0 )
+        mem = VirtualAllocExNuma( GetCurrentProcess(), NULL, *size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, (DWORD)node );
+
+    return mem ? mem : VirtualAlloc( NULL, *size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+#else
+    void * mem = malloc( *size );
+    *size = 0;
+    return mem;
+#endif
+}
+
+static void soque_mem_free( void * mem, size_t size )
+{
+    if( size == 0 )
+    {
+        free( mem );
+        return;
+    }
+
+#if defined( __linux__ )
+    munmap( mem, size );
+#elif defined( _WIN32 )
+    VirtualFree( mem, 0, MEM_RELEASE );
+#endif
+}
+
+// slots reserved or not popped yet
+uint32_t SOQUE::used()
+{
+    uint32_t size = ring_size();
+    uint32_t push_here = q_push_run.load( std::memory_order_relaxed ) % size;
+
+    return ( push_here + size - q_pop.load( std::memory_order_relaxed ) ) % size;
+}
+
+// flows keep their keys by slot and are not resized
+uint8_t SOQUE::resizable( uint32_t size )
+{
+    return size >= 2 && size <= SOQUE_RUN_FROZEN / 2 && !( size & ( size - 1 ) ) && !( q_flags & SOQUE_FLAG_FLOWS );
+}
+
+// push owner side: freeze q_push_run, so the next pop() finding nothing processed switches the ring;
+// queues own their slots when they have them, a one stage slot queue growing freezes q_proc_run too and
+// carries what is left unclaimed into the new ring, producers wait for the batches in proc only;
+// index queues keep their payload by slot index outside, so they drain first; 0 = refused or guard busy
+uint8_t SOQUE::resize( uint32_t size )
+{
+    if( !resizable( size ) || !push_enter() )
+        return 0;
+
+    // push guard orders both for resize_switch
+    if( size != ring_size() || q_resize.load( std::memory_order_relaxed ) )
+    {
+        q_resize.store( size, std::memory_order_relaxed );
+        q_push_run.fetch_or( SOQUE_RUN_FROZEN, std::memory_order_relaxed );
+
+        if( q_stride && stage_last() == 0 && size > ring_size() )
+            q_proc_run.fetch_or( SOQUE_RUN_FROZEN, std::memory_order_relaxed );
+        else if( q_proc_run.load( std::memory_order_relaxed ) & SOQUE_RUN_FROZEN )
+            q_proc_run.fetch_and( SOQUE_RUN_MASK, std::memory_order_relaxed );
+    }
+
+    push_leave();
+
+    return 1;
+}
+
+// pop owner, nothing processed left: once every reservation is committed, claimed and processed nobody
+// holds a slot, so the ring starts over at slot 0 of the new size; the runs restart past the frozen ones,
+// CASes of whoever still looks at the old ring fail; the stage head guards keep stage_retire out;
+// a carrying resize needs no claims in flight only, the slots pushed since move to 0.. of the new ring
+void SOQUE::resize_switch()
+{
+    uint32_t here = q_pop.load( std::memory_order_relaxed );
+    uint32_t size;
+    uint32_t push_run;
+    uint32_t proc_run;
+    uint32_t push_here;
+    uint32_t carried = 0;
+    uint8_t carrying;
+    uint32_t base;
+    size_t area_size;
+    size_t mem_size = 0;
+    void * mem = NULL;
+    std::atomic<uint64_t> * area = inline_markers;
+    std::vector<uint8_t> carry;
+#ifdef SOQUE_LATENCY
+    std::vector<SOQUE_STAMP> carry_stamps;
+#endif
+
+    if( !push_enter() )
+        return;
+
+    if( !stages_enter() )
+    {
+        push_leave();
+        return;
+    }
+
+    size = q_resize.load( std::memory_order_relaxed );
+    push_run = q_push_run.load( std::memory_order_relaxed );
+    push_here = q_push.load( std::memory_order_acquire );
+    proc_run = q_proc_run.load( std::memory_order_acquire );
+    area_size = soque_area_size( size, q_flags, q_stride );
+
+    // carrying: claims frozen by resize, the last claimed one retired and popped
+    carrying = ( proc_run & SOQUE_RUN_FROZEN ) != 0;
+
+    if( carrying )
+    {
+        proc_run &= SOQUE_RUN_MASK;
+
+        if( size == 0 || push_run % ring_size() != push_here || proc_run % ring_size() != here )
+        {
+            stages_leave( stage_last() );
+            push_leave();
+            return;
+        }
+
+        carried = ( push_here + ring_size() - here ) % ring_size();
+    }
+    else
+    {
+        proc_run = push_run & SOQUE_RUN_MASK;
+
+        if( size == 0 || push_run % ring_size() != here || push_here != here )
+        {
+            stages_leave( stage_last() );
+            push_leave();
+            return;
+        }
+    }
+
+    if( size > q_inline )
+    {
+        mem_size = area_size + CACHELINE_SIZE;
+        mem = soque_mem_alloc( &mem_size, q_node, ( q_flags & SOQUE_FLAG_HUGE ) != 0 );
+
+        if( !mem )
+        {
+            stages_leave( stage_last() );
+            push_leave();
+            return;
+        }
+
+        area = CACHELINE_SHIFT( mem, std::atomic<uint64_t> * );
+        memset( (void *)area, 0, area_size );
+    }
+
+    // out of the old ring before the inline area is cleared, it may be the new one as well; the slots left
+    // behind are cleared, an inline ring taken up again has them as popped ones
+    if( carried )
+    {
+        carry.resize( (size_t)carried * q_stride );
+#ifdef SOQUE_LATENCY
+        carry_stamps.resize( carried );
+#endif
+
+        for( uint32_t c = 0, i = here; c < carried; c++ )
+        {
+            memcpy( &carry[(size_t)c * q_stride], slots + (size_t)i * q_stride, q_stride );
+            memset( slots + (size_t)i * q_stride, 0, q_stride );
+#ifdef SOQUE_LATENCY
+            carry_stamps[c] = stamps()[i];
+#endif
+
+            if( ++i == ring_size() )
+                i = 0;
+        }
+    }
+
+    if( !mem )
+    {
+        // a smaller ring left its stamps and flow keys where this size has markers, up to the inline slots
+        memset( (void *)area, 0, soque_slots_offset( size, q_flags ) );
+    }
+
+    // claimed all
+    if( !carrying && !q_proc_run.compare_exchange_strong( proc_run, proc_run | SOQUE_RUN_FROZEN, std::memory_order_acquire, std::memory_order_relaxed ) )
+    {
+        if( mem )
+            soque_mem_free( mem, mem_size );
+
+        stages_leave( stage_last() );
+        push_leave();
+        return;
+    }
+
+    // later stages are as far, nothing is left between them
+    for( uint32_t k = 1; k <= stage_last(); k++ )
+    {
+#ifdef _DEBUG
+        assert( stages[k].run.fetch_or( SOQUE_RUN_FROZEN, std::memory_order_relaxed ) == proc_run );
+#else
+        stages[k].run.fetch_or( SOQUE_RUN_FROZEN, std::memory_order_relaxed );
+#endif
+    }
+
+    q_epoch.fetch_add( 1, std::memory_order_acq_rel );
+
+    // the markers left are clear; slots keep what was popped
+    if( retired_alloc )
+        soque_mem_free( retired_alloc, retired_size );
+
+    retired_alloc = markers_alloc;
+    retired_size = markers_size;
+    markers_alloc = mem;
+    markers_size = mem_size;
+    markers = area;
+
+    if( q_stride )
+        slots = (uint8_t *)area + soque_slots_offset( mem ? size : q_inline, q_flags );
+
+    q_size.store( size, std::memory_order_relaxed );
+
+    if( carried )
+    {
+        memcpy( slots, &carry[0], carry.size() );
+#ifdef SOQUE_LATENCY
+        memcpy( (void *)stamps(), &carry_stamps[0], sizeof( SOQUE_STAMP ) * carried );
+#endif
+    }
+
+    q_push.store( carried, std::memory_order_relaxed );
+    q_proc.store( 0, std::memory_order_relaxed );
+    q_pop.store( 0, std::memory_order_relaxed );
+    q_resize.store( 0, std::memory_order_relaxed );
+
+    for( uint32_t k = 0; k < stage_last(); k++ )
+        stages[k].head.store( 0, std::memory_order_relaxed );
+
+    base = ( ( proc_run | ( size - 1 ) ) + 1 ) & SOQUE_RUN_MASK;
+
+    q_epoch.fetch_add( 1, std::memory_order_release );
+
+    for( uint32_t k = 1; k <= stage_last(); k++ )
+        stages[k].run.store( base, std::memory_order_release );
+
+    q_proc_run.store( base, std::memory_order_release );
+    q_push_run.store( ( base + carried ) & SOQUE_RUN_MASK, std::memory_order_release );
+
+    stages_leave( stage_last() );
+    push_leave();
+
+    // wake push event armed on the frozen ring, the fence pairs with the one in push_reserve
+    if( push_fd >= 0 )
+    {
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+
+        if( push_armed.load( std::memory_order_relaxed ) && push_armed.exchange( false, std::memory_order_relaxed ) )
+            soque_event_signal( push_fd );
+    }
+}
+
+static SOQUE_HANDLE soque_alloc( uint32_t size, uint32_t flags, uint32_t stride, void * cb_arg, soque_push_cb push_cb, soque_proc_cb proc_cb, soque_pop_cb pop_cb, soque_pop_batch_cb pop_batch_cb )
+{
+    if( ( ( (uint32_t)-1 ) % size ) != size - 1 )
+        return NULL;
+
+    if( ( flags & SOQUE_FLAG_RANGES ) && ( flags & SOQUE_FLAG_FLOWS ) )
+        return NULL;
+
+    int32_t node = (int32_t)( flags >> SOQUE_FLAG_NODE_SHIFT ) - 1;
+    size_t mem_size = sizeof( SOQUE ) + soque_area_size( size, flags & ~SOQUE_FLAG_NODE_MASK, stride ) + CACHELINE_SIZE;
+    void * mem = soque_mem_alloc( &mem_size, node, ( flags & SOQUE_FLAG_HUGE ) != 0 );
+
+    if( !mem )
+        return NULL;
+
+    SOQUE_HANDLE sh = CACHELINE_SHIFT( mem, SOQUE_HANDLE );
+    sh->open( size, flags, stride, cb_arg, push_cb, proc_cb, pop_cb, pop_batch_cb );
+    sh->original_alloc = mem;
+    sh->original_size = mem_size;
+
+    return sh;
+}
+
+SOQUE_HANDLE SOQUE_CALL soque_open_ex( uint32_t size, uint32_t flags, void * cb_arg, soque_push_cb push_cb, soque_proc_cb proc_cb, soque_pop_cb pop_cb )
+{
+    return soque_alloc( size, flags & ~( SOQUE_FLAG_FLOWS | SOQUE_FLAG_STAGES_MASK ), 0, cb_arg, push_cb, proc_cb, pop_cb, NULL );
+}
+
+SOQUE_HANDLE SOQUE_CALL soque_open_slots( uint32_t size, uint32_t slot_size, uint32_t flags, void * cb_arg, soque_push_cb push_cb, soque_proc_cb proc_cb, soque_pop_cb pop_cb )
+{
+    if( slot_size == 0 )
+        return NULL;
+
+    return soque_alloc( size, flags & ~( SOQUE_FLAG_FLOWS | SOQUE_FLAG_STAGES_MASK ), soque_slot_stride( slot_size ), cb_arg, push_cb, proc_cb, pop_cb, NULL );
+}
+
+// a slot goes through the stages in turn, each claims and batches on its own; pop sees it after the last
+SOQUE_HANDLE SOQUE_CALL soque_open_stages( uint32_t size, uint32_t slot_size, uint32_t stages, uint32_t flags, void * cb_arg, soque_push_cb push_cb, const soque_proc_cb * proc_cbs, soque_pop_cb pop_cb )
+{
+    SOQUE_HANDLE sh;
+
+    if( stages == 0 || stages > SOQUE_STAGES_MAX || ( flags & ( SOQUE_FLAG_RANGES | SOQUE_FLAG_FLOWS ) ) )
+        return NULL;
+
+    flags = ( flags & ~SOQUE_FLAG_STAGES_MASK ) | ( ( stages - 1 ) << SOQUE_FLAG_STAGES_SHIFT );
+    sh = soque_alloc( size, flags, slot_size ? soque_slot_stride( slot_size ) : 0, cb_arg, push_cb, proc_cbs ? proc_cbs[0] : NULL, pop_cb, NULL );
+
+    for( uint32_t k = 1; sh && proc_cbs && k < stages; k++ )
+        sh->stages[k].proc_cb = proc_cbs[k];
+
+    return sh;
+}
+
+SOQUE_HANDLE SOQUE_CALL soque_open_flows( uint32_t size, uint32_t flags, void * cb_arg, soque_push_cb push_cb, soque_proc_cb proc_cb, soque_pop_batch_cb pop_batch_cb )
+{
+    return soque_alloc( size, ( flags | SOQUE_FLAG_FLOWS ) & ~SOQUE_FLAG_STAGES_MASK, 0, cb_arg, push_cb, proc_cb, NULL, pop_batch_cb );
+}
+
+SOQUE_HANDLE SOQUE_CALL soque_open( uint32_t size, void * cb_arg, soque_push_cb push_cb, soque_proc_cb proc_cb, soque_pop_cb pop_cb )
+{
+    return soque_open_ex( size, 0, cb_arg, push_cb, proc_cb, pop_cb );
+}
+
+uint8_t SOQUE_CALL soque_pp_enter( SOQUE_HANDLE sh )
+{
+    return sh->pp_enter();
+}
+
+void SOQUE_CALL soque_pp_leave( SOQUE_HANDLE sh )
+{
+    sh->pp_leave();
+}
+
+uint8_t SOQUE_CALL soque_pop_enter( SOQUE_HANDLE sh )
+{
+    return sh->pop_enter();
+}
+
+void SOQUE_CALL soque_pop_leave( SOQUE_HANDLE sh )
+{
+    sh->pop_leave();
+}
+
+uint8_t SOQUE_CALL soque_push_enter( SOQUE_HANDLE sh )
+{
+    return sh->push_enter();
+}
+
+void SOQUE_CALL soque_push_leave( SOQUE_HANDLE sh )
+{
+    sh->push_leave();
+}
+
+uint32_t SOQUE_CALL soque_push( SOQUE_HANDLE sh, uint32_t push_count )
+{
+    return sh->push( push_count );
+}
+
+void * SOQUE_CALL soque_slot( SOQUE_HANDLE sh, uint32_t index )
+{
+    return sh->slots ? sh->slots + (size_t)index * sh->q_stride : NULL;
+}
+
+// sh or a queue downstream of it links to target
+static uint8_t soque_reaches( SOQUE_HANDLE sh, SOQUE_HANDLE target )
+{
+    if( sh == target )
+        return 1;
+
+    for( uint32_t i = 0; sh->link && i < sh->link->to.size(); i++ )
+        if( soque_reaches( sh->link->to[i], target ) )
+            return 1;
+
+    return 0;
+}
+
+uint8_t SOQUE_CALL soque_link( SOQUE_HANDLE sh, const SOQUE_HANDLE * to, uint32_t to_count, soque_route_cb route )
+{
+    SOQUE_LINK * link;
+
+    if( to_count == 0 )
+    {
+        delete sh->link;
+        sh->link = NULL;
+        return 1;
+    }
+
+    if( !sh->slots || ( sh->q_flags & SOQUE_FLAG_FLOWS ) || ( to_count > 1 && !route ) )
+        return 0;
+
+    // a destination takes whole slots through push_reserve, which a push_cb of its own would race
+    for( uint32_t i = 0; i < to_count; i++ )
+        if( !to[i]->slots || to[i]->q_stride < sh->q_stride || to[i]->push_cb || ( to[i]->q_flags & SOQUE_FLAG_FLOWS ) || soque_reaches( to[i], sh ) )
+            return 0;
+
+    link = new SOQUE_LINK;
+    link->to.assign( to, to + to_count );
+    link->route = route;
+
+    delete sh->link;
+    sh->link = link;
+
+    return 1;
+}
+
+uint32_t SOQUE_CALL soque_link_move( SOQUE_HANDLE sh, uint32_t batch )
+{
+    return sh->link ? sh->link_move( batch ) : 0;
+}
+
+uint32_t * SOQUE_CALL soque_flow_keys( SOQUE_HANDLE sh )
+{
+    return ( sh->q_flags & SOQUE_FLAG_FLOWS ) ? sh->flow_keys() : NULL;
+}
+
+SOQUE_BATCH SOQUE_CALL soque_push_reserve( SOQUE_HANDLE sh, uint32_t batch )
+{
+    return sh->push_reserve( batch );
+}
+
+void SOQUE_CALL soque_push_commit( SOQUE_HANDLE sh, SOQUE_BATCH push_batch )
+{
+    sh->push_commit( push_batch );
+}
+
+SOQUE_BATCH SOQUE_CALL soque_proc_get( SOQUE_HANDLE sh, uint32_t batch )
+{
+    return sh->proc_get( batch, NULL );
+}
+
+void SOQUE_CALL soque_proc_done( SOQUE_HANDLE sh, SOQUE_BATCH proc_batch )
+{
+    sh->stage_done( 0, proc_batch );
+}
+
+SOQUE_BATCH SOQUE_CALL soque_stage_get( SOQUE_HANDLE sh, uint32_t stage, uint32_t batch )
+{
+    SOQUE_BATCH proc_batch = { 0, 0 };
+
+    if( stage > sh->stage_last() )
+        return proc_batch;
+
+    return sh->stage_get( stage, batch, NULL );
+}
+
+void SOQUE_CALL soque_stage_done( SOQUE_HANDLE sh, uint32_t stage, SOQUE_BATCH proc_batch )
+{
+    if( stage <= sh->stage_last() )
+        sh->stage_done( stage, proc_batch );
+}
+
+uint32_t SOQUE_CALL soque_pop( SOQUE_HANDLE sh, uint32_t pop_count )
+{
+    return sh->pop( pop_count );
+}
+
+SOQUE_BATCH SOQUE_CALL soque_pop_get( SOQUE_HANDLE sh, uint32_t batch )
+{
+    return sh->pop_get( batch );
+}
+
+void SOQUE_CALL soque_pop_done( SOQUE_HANDLE sh, SOQUE_BATCH pop_batch )
+{
+    sh->pop_done( pop_batch );
+}
+
+int SOQUE_CALL soque_event_fd( SOQUE_HANDLE sh, uint32_t event, uint32_t watermark )
+{
+    return sh->event_fd( event, watermark );
+}
+
+// where the memory is, not where it was asked for: mbind is a preference and huge pages may come from elsewhere
+int32_t SOQUE_CALL soque_node( SOQUE_HANDLE sh )
+{
+#if defined( __linux__ )
+    int node = -1;
+
+    if( syscall( SYS_get_mempolicy, &node, NULL, 0, (void *)sh, SOQUE_MPOL_F_NODE | SOQUE_MPOL_F_ADDR ) == 0 )
+        return node;
+#elif defined( _WIN32 )
+    PSAPI_WORKING_SET_EX_INFORMATION ws;
+
+    ws.VirtualAddress = (void *)sh;
+
+    if( QueryWorkingSetEx( GetCurrentProcess(), &ws, sizeof( ws ) ) && ws.VirtualAttributes.Valid )
+        return (int32_t)ws.VirtualAttributes.Node;
+#endif
+
+    return -1;
+}
+
+void SOQUE_CALL soque_stats( SOQUE_HANDLE sh, SOQUE_STATS * st )
+{
+    sh->stats( st );
+}
+
+uint32_t SOQUE_CALL soque_latency( SOQUE_HANDLE sh, uint32_t kind, uint64_t * buckets, uint8_t reset )
+{
+#ifdef SOQUE_LATENCY
+    if( kind >= SOQUE_LATENCY_KINDS )
+        return 0;
+
+    if( buckets )
+        memcpy( buckets, sh->latency[kind], sizeof( sh->latency[kind] ) );
+
+    if( reset )
+        sh->latency_reset = true;
+
+    return SOQUE_LATENCY_BUCKETS;
+#else
+    (void)sh;
+    (void)kind;
+    (void)buckets;
+    (void)reset;
+    return 0;
+#endif
+}
+
+void SOQUE_CALL soque_close( SOQUE_HANDLE sh )
+{
+    void * mem = sh->original_alloc;
+    size_t size = sh->original_size;
+    sh->close();
+
+    if( sh->markers_alloc )
+        soque_mem_free( sh->markers_alloc, sh->markers_size );
+
+    if( sh->retired_alloc )
+        soque_mem_free( sh->retired_alloc, sh->retired_size );
+
+    soque_mem_free( mem, size );
+}
+
+uint32_t SOQUE_CALL soque_resize( SOQUE_HANDLE sh, uint32_t size )
+{
+    if( size && !sh->resizable( size ) )
+        return 0;
+
+    // a push step holds the guard for a push_cb call at most
+    while( size && !sh->resize( size ) )
+        std::this_thread::yield();
+
+    // already empty: switch here unless someone else owns the pop side
+    if( size && sh->pop_enter() )
+    {
+        sh->pop( 0 );
+        sh->pop_leave();
+    }
+
+    return sh->ring_size();
+}
+
+// cpu topology: sysfs under SOQUE_SYSFS (default /sys), a fake tree there may also
+// hold an "affinity" cpulist to stand in for sched_getaffinity
+struct SOQUE_CPU
+{
+    uint32_t id;
+    int32_t node;
+    uint32_t core; // lowest smt sibling
+    uint8_t isolated;
+};
+
+#ifdef __linux__
+static uint8_t soque_cpulist( const char * root, const char * path, std::vector<uint32_t> & list )
+{
+    char name[PATH_MAX];
+    char text[4096];
+    FILE * f;
+    size_t n;
+
+    snprintf( name, sizeof( name ), "%s%s", root, path );
+    f = fopen( name, "r" );
+
+    if( !f )
+        return 0;
+
+    n = fread( text, 1, sizeof( text ) - 1, f );
+    fclose( f );
+    text[n] = 0;
+
+    for( char * p = text; *p >= '0' && *p <= '9'; )
+    {
+        uint32_t a = (uint32_t)strtoul( p, &p, 10 );
+        uint32_t b = a;
+
+        if( *p == '-' )
+            b = (uint32_t)strtoul( p + 1, &p, 10 );
+
+        for( ; a <= b; a++ )
+            list.push_back( a );
+
+        if( *p == ',' )
+            p++;
+    }
+
+    return 1;
+}
+#endif
+
+static void soque_topology( std::vector<SOQUE_CPU> & cpus )
+{
+    cpus.clear();
+
+#if defined( __linux__ )
+    const char * root = getenv( "SOQUE_SYSFS" );
+    std::vector<uint32_t> allowed;
+    std::vector<uint32_t> nodes;
+    std::vector<uint32_t> isolated;
+    char path[64];
+
+    if( !root )
+        root = "/sys";
+
+    if( !soque_cpulist( root, "/affinity", allowed ) )
+    {
+        cpu_set_t cpuset;
+
+        if( sched_getaffinity( 0, sizeof( cpuset ), &cpuset ) == 0 )
+            for( uint32_t i = 0; i < CPU_SETSIZE; i++ )
+                if( CPU_ISSET( i, &cpuset ) )
+                    allowed.push_back( i );
+    }
+
+    soque_cpulist( root, "/devices/system/cpu/isolated", isolated );
+    soque_cpulist( root, "/devices/system/node/online", nodes );
+
+    for( uint32_t i = 0; i < allowed.size(); i++ )
+    {
+        SOQUE_CPU cpu = { allowed[i], -1, allowed[i], 0 };
+        std::vector<uint32_t> siblings;
+
+        snprintf( path, sizeof( path ), "/devices/system/cpu/cpu%u/topology/thread_siblings_list", cpu.id );
+
+        if( soque_cpulist( root, path, siblings ) && siblings.size() )
+            cpu.core = siblings[0];
+
+        for( uint32_t j = 0; j < nodes.size() && cpu.node < 0; j++ )
+        {
+            std::vector<uint32_t> node_cpus;
+
+            snprintf( path, sizeof( path ), "/devices/system/node/node%u/cpulist", nodes[j] );
+            soque_cpulist( root, path, node_cpus );
+
+            for( uint32_t k = 0; k < node_cpus.size(); k++ )
+                if( node_cpus[k] == cpu.id )
+                    cpu.node = (int32_t)nodes[j];
+        }
+
+        for( uint32_t j = 0; j < isolated.size(); j++ )
+            if( isolated[j] == cpu.id )
+                cpu.isolated = 1;
+
+        cpus.push_back( cpu );
+    }
+#elif defined( _WIN32 )
+    DWORD_PTR process_mask;
+    DWORD_PTR system_mask;
+
+    if( GetProcessAffinityMask( GetCurrentProcess(), &process_mask, &system_mask ) )
+    {
+        for( uint32_t i = 0; i < sizeof( DWORD_PTR ) * 8; i++ )
+        {
+            UCHAR node;
+            SOQUE_CPU cpu = { i, -1, i, 0 };
+
+            if( !( process_mask & ( (DWORD_PTR)1 << i ) ) )
+                continue;
+
+            if( GetNumaProcessorNode( (UCHAR)i, &node ) && node != 0xFF )
+                cpu.node = node;
+
+            cpus.push_back( cpu );
+        }
+    }
+#endif
+
+    if( cpus.empty() )
+    {
+        for( uint32_t i = 0; i < std::thread::hardware_concurrency(); i++ )
+        {
+            SOQUE_CPU cpu = { i, -1, i, 0 };
+            cpus.push_back( cpu );
+        }
+    }
+}
+
+// workers pinned per cpu id, over all pools
+static std::mutex soque_cpus_lock;
+static std::mutex soque_sets_lock; // attach / detach / stats against the pool's queue set
+static std::vector<uint32_t> soque_cpus_load;
+
+static uint8_t soque_pin( std::thread & thread, const uint32_t * ids, uint32_t count )
+{
+#ifdef _WIN32
+
+    DWORD_PTR mask = 0;
+
+    for( uint32_t i = 0; i < count; i++ )
+        if( ids[i] < sizeof( DWORD_PTR ) * 8 )
+            mask |= (DWORD_PTR)1 << ids[i];
+
+    return mask && SetThreadAffinityMask( thread.native_handle(), mask ) != 0;
+
+#elif !defined __CYGWIN__
+
+    cpu_set_t cpuset;
+    CPU_ZERO( &cpuset );
+
+    for( uint32_t i = 0; i < count; i++ )
+        if( ids[i] < CPU_SETSIZE )
+            CPU_SET( ids[i], &cpuset );
+
+    return pthread_setaffinity_np( thread.native_handle(), sizeof( cpu_set_t ), &cpuset ) == 0;
+
+#else
+
+    (void)thread;
+    (void)ids;
+    (void)count;
+    return 0;
+
+#endif
+}
+
+// std::allocator ignores over-alignment before c++17, per worker meters would share lines across vector elements
+template<typename T> struct CACHELINE_ALLOCATOR
+{
+    typedef T value_type;
+
+    CACHELINE_ALLOCATOR() {}
+    template<typename U> CACHELINE_ALLOCATOR( const CACHELINE_ALLOCATOR<U> & ) {}
+
+    T * allocate( size_t n )
+    {
+#ifdef _WIN32
+        void * p = _aligned_malloc( n * sizeof( T ), CACHELINE_SIZE );
+#else
+        void * p = NULL;
+        if( posix_memalign( &p, CACHELINE_SIZE, n * sizeof( T ) ) != 0 )
+            p = NULL;
+#endif
+        if( !p )
+            throw std::bad_alloc();
+        return (T *)p;
+    }
+
+    void deallocate( T * p, size_t )
+    {
+#ifdef _WIN32
+        _aligned_free( p );
+#else
+        free( p );
+#endif
+    }
+
+    template<typename U> bool operator==( const CACHELINE_ALLOCATOR<U> & ) const { return true; }
+    template<typename U> bool operator!=( const CACHELINE_ALLOCATOR<U> & ) const { return false; }
+};
+
+#define SOQUE_SET_QUIESCENT 0xFFFFFFFF
+
+struct SOQUE_THREADS
+{
+    std::atomic<uint8_t> shutdown;
+    uint32_t threads_count;
+    std::atomic<uint32_t> soques_count;
+    std::atomic<uint32_t> workers_count;
+    std::atomic<uint32_t> parked;
+    std::atomic<uint32_t> park_seq;
+    uint32_t batch;
+    uint32_t threshold;
+    uint32_t reaction;
+    std::atomic<uint32_t> lrt;
+
+    // utilization = 0 wakes workers by items/sec over threshold, otherwise by busy time;
+    // workers_min / workers_max bound all workers in both modes, homes included,
+    // workers_count by what is over the homes at the time
+    std::atomic<uint32_t> utilization;
+    std::atomic<uint32_t> workers_min;
+    std::atomic<uint32_t> workers_max;
+
+    // rings resized by occupancy within size_min..size_max, size_max = 0 leaves them be
+    uint32_t size_min;
+    uint32_t size_max;
+
+    // adaptive proc batch per queue, batch_max = 0 keeps the fixed batch;
+    // every worker serving the queue adapts it through relaxed atomics, a racing cost sample may be lost
+    struct BATCHING
+    {
+        std::atomic<uint32_t> batch;
+        std::atomic<uint32_t> cost; // tsc per item
+        uint8_t pad[CACHELINE_SIZE - 2 * sizeof( uint32_t )];
+    };
+
+    std::atomic<uint32_t> batch_min; // set while workers adapt
+    std::atomic<uint32_t> batch_max;
+    std::atomic<uint32_t> latency_us;
+    std::atomic<uint32_t> tsc_per_us; // orchestra measured
+    std::atomic<uint32_t> threads_sync;
+    std::vector<std::thread> threads;
+
+    // meters have a single writer and no atomics, stats readers take them as they are
+    struct WORKER_METERS
+    {
+        CACHELINE_ALIGN( uint64_t processed );
+        uint64_t idle_loops;
+        uint64_t parked_us;
+        uint64_t busy_tsc; // in proc_cb
+        uint64_t awake_tsc; // in rounds, parking excluded
+        uint8_t pad[CACHELINE_SIZE - 5 * sizeof( uint64_t )];
+    };
+
+    struct QUEUE_METERS
+    {
+        CACHELINE_ALIGN( uint64_t enter_fails );
+        uint64_t proc_retries;
+        uint64_t push_calls;
+        uint64_t push_items;
+        uint64_t pop_calls;
+        uint64_t pop_items;
+        uint64_t proc_items;
+        int64_t deficit; // drr credit in slots
+        uint64_t push_yields; // push_cb returned 0
+        uint64_t pop_yields;
+    }; // two cache lines
+
+    static_assert( sizeof( WORKER_METERS ) == CACHELINE_SIZE && sizeof( QUEUE_METERS ) % CACHELINE_SIZE == 0, "meters take whole cache lines" );
+
+    std::vector<WORKER_METERS, CACHELINE_ALLOCATOR<WORKER_METERS>> t_meters;
+    std::vector<int32_t> t_cpus; // pinned cpu per worker, -1 = unbound
+
+    // a queue while attached, with its pool side state
+    struct POOL_QUEUE
+    {
+        BATCHING bc;
+        SOQUE_HANDLE sh;
+        uint32_t pop_lrt;
+        uint32_t push_lrt;
+        std::atomic<uint32_t> delay_us; // waitable past it, 0 = by lrt
+        uint64_t pop_since; // tsc of the oldest item the pop side left, 0 = none; pop owner
+        uint64_t push_since; // tsc of the last push; push owner
+        uint32_t full_rounds; // orchestra only
+        uint32_t calm_rounds;
+        uint32_t prio; // class, higher first; under soque_sets_lock, workers see it in the set
+        std::atomic<uint32_t> weight; // proc batches per visit
+        uint64_t proc_last; // orchestra only
+        std::atomic<uint32_t> share; // per mille of the pool's proc items last orchestra round
+        std::vector<QUEUE_METERS, CACHELINE_ALLOCATOR<QUEUE_METERS>> meters; // one per worker
+    };
+
+    // attached queues, never changed once published: attach / detach publish a new set under
+    // soque_sets_lock and free the old one after every worker has left it; t_gens is the set
+    // generation each worker holds, SOQUE_SET_QUIESCENT while it holds none (parked)
+    struct QUEUE_SET
+    {
+        std::vector<POOL_QUEUE *> queues;
+        std::vector<uint32_t> prios; // of queues when published
+    };
+
+    std::atomic<QUEUE_SET *> qset;
+    std::atomic<uint32_t> qgen;
+    std::vector<std::atomic<uint32_t>> t_gens;
+
+    // worker side: a set and its generation, seen as a pair; publish stores the set before the
+    // generation, so a worker that took the new generation holds the new set, and one that took
+    // the old generation with either set is waited for
+    QUEUE_SET * hold_set( uint32_t thread_id )
+    {
+        QUEUE_SET * set;
+        uint32_t gen;
+
+        do
+        {
+            gen = qgen;
+            t_gens[thread_id] = gen;
+            set = qset;
+        }
+        while( qgen != gen || qset != set );
+
+        return set;
+    }
+
+    // publish queues as the new set, return once no worker is left in the old one
+    void publish( std::vector<POOL_QUEUE *> & queues )
+    {
+        QUEUE_SET * set = new QUEUE_SET;
+        QUEUE_SET * old = qset;
+        uint32_t gen = qgen + 1;
+
+        set->queues.swap( queues );
+
+        for( uint32_t i = 0; i < set->queues.size(); i++ )
+            set->prios.push_back( set->queues[i]->prio );
+        soques_count = (uint32_t)set->queues.size();
+        qset = set;
+        qgen = gen;
+
+        // parked workers woke by a wake point of the old set, they take the new one
+        unpark();
+
+        for( uint32_t t = 0; t < threads_count; t++ )
+            while( t_gens[t] < gen )
+                std::this_thread::yield();
+
+        delete old;
+    }
+
+    POOL_QUEUE * pool_queue( SOQUE_HANDLE sh )
+    {
+        POOL_QUEUE * pq = new POOL_QUEUE();
+
+        pq->sh = sh;
+        pq->bc.batch.store( batch_min, std::memory_order_relaxed );
+        pq->weight = 1;
+        pq->meters.resize( threads_count );
+#ifdef _DEBUG
+        assert( (uintptr_t)pq->meters.data() % CACHELINE_SIZE == 0 );
+#endif
+
+        return pq;
+    }
+
+    // sh and every queue downstream of it not served yet, upstream before downstream,
+    // so a round of the set moves slots on before it processes where they went
+    uint8_t add_graph( std::vector<POOL_QUEUE *> & queues, SOQUE_HANDLE sh )
+    {
+        for( uint32_t i = 0; i < queues.size(); i++ )
+            if( queues[i]->sh == sh )
+                return 0;
+
+        queues.push_back( pool_queue( sh ) );
+
+        for( uint32_t i = 0; sh->link && i < sh->link->to.size(); i++ )
+            add_graph( queues, sh->link->to[i] );
+
+        return 1;
+    }
+
+    uint8_t delay( SOQUE_HANDLE sh, uint32_t delay_us )
+    {
+        std::vector<POOL_QUEUE *> & queues = qset.load()->queues;
+
+        for( uint32_t i = 0; i < queues.size(); i++ )
+        {
+            if( queues[i]->sh == sh )
+            {
+                queues[i]->delay_us.store( delay_us, std::memory_order_relaxed );
+                return 1;
+            }
+        }
+
+        return 0;
+    }
+
+    // republished, so every worker rebuilds its rounds
+    uint8_t priority( SOQUE_HANDLE sh, uint32_t prio, uint32_t weight )
+    {
+        std::vector<POOL_QUEUE *> queues = qset.load()->queues;
+
+        for( uint32_t i = 0; i < queues.size(); i++ )
+        {
+            if( queues[i]->sh == sh )
+            {
+                queues[i]->prio = prio;
+                queues[i]->weight.store( weight < 1 ? 1 : weight > SOQUE_WEIGHT_MAX ? SOQUE_WEIGHT_MAX : weight, std::memory_order_relaxed );
+                publish( queues );
+                return 1;
+            }
+        }
+
+        return 0;
+    }
+
+    uint8_t attach( SOQUE_HANDLE sh )
+    {
+        std::vector<POOL_QUEUE *> queues = qset.load()->queues;
+
+        if( !add_graph( queues, sh ) )
+            return 0;
+
+        publish( queues );
+
+        return 1;
+    }
+
+    // once published no worker is in the queue and its proc batches are done;
+    // drain procs and pops what was left in the caller's thread, returns slots still in use
+    uint32_t detach( SOQUE_HANDLE sh, uint8_t drain )
+    {
+        std::vector<POOL_QUEUE *> & current = qset.load()->queues;
+        std::vector<POOL_QUEUE *> queues;
+        POOL_QUEUE * gone = NULL;
+        SOQUE_STATS st;
+
+        for( uint32_t i = 0; i < current.size(); i++ )
+        {
+            if( current[i]->sh == sh )
+                gone = current[i];
+            else
+                queues.push_back( current[i] );
+        }
+
+        if( !gone )
+            return SOQUE_SET_QUIESCENT;
+
+        publish( queues );
+
+        if( drain )
+        {
+            WORKER_METERS wm;
+            QUEUE_METERS qm;
+
+            memset( (void *)&wm, 0, sizeof( wm ) );
+            memset( (void *)&qm, 0, sizeof( qm ) );
+            sh->stats( &st );
+
+            // what was there at detach, new pushes are the caller's
+            for( uint32_t left = st.size - 1 - st.free; left; )
+            {
+                uint32_t popped;
+
+                while( proc( gone, &wm, &qm ) )
+                    continue;
+
+                popped = pop( gone, &qm );
+
+                if( popped == 0 )
+                    break;
+
+                left = popped < left ? left - popped : 0;
+            }
+        }
+
+        delete gone;
+
+        sh->stats( &st );
+        return st.size - 1 - st.free;
+    }
+
+    // numa node most of the worker's home queues live on
+    int32_t home_node( uint32_t thread_id )
+    {
+        std::vector<uint32_t> counts;
+        int32_t node = -1;
+        std::vector<POOL_QUEUE *> & queues = qset.load()->queues;
+
+        for( uint32_t i = 0; i < queues.size(); i++ )
+        {
+            int32_t n = home_of( thread_id, i, (uint32_t)queues.size() ) ? soque_node( queues[i]->sh ) : -1;
+
+            if( n < 0 )
+                continue;
+
+            if( counts.size() <= (uint32_t)n )
+                counts.resize( n + 1 );
+
+            if( ++counts[n] > ( node < 0 ? 0 : counts[node] ) )
+                node = n;
+        }
+
+        return node;
+    }
+
+    // least loaded cpu: on the node if it has one, then least loaded core, then lowest id
+    static int32_t place_one( const std::vector<SOQUE_CPU> & cpus, int32_t node, uint8_t nosmt )
+    {
+        int32_t best = -1;
+        uint64_t best_score = 0;
+        uint8_t on_node = 0;
+
+        for( uint32_t i = 0; i < cpus.size(); i++ )
+            if( node >= 0 && cpus[i].node == node )
+                on_node = 1;
+
+        for( uint32_t i = 0; i < cpus.size(); i++ )
+        {
+            uint32_t core_load = 0;
+            uint64_t score;
+
+            if( on_node && cpus[i].node != node )
+                continue;
+
+            for( uint32_t j = 0; j < cpus.size(); j++ )
+                if( cpus[j].core == cpus[i].core )
+                    core_load += soque_cpus_load[cpus[j].id];
+
+            if( nosmt && core_load )
+                continue;
+
+            score = ( (uint64_t)soque_cpus_load[cpus[i].id] << 32 ) | core_load;
+
+            if( best < 0 || score < best_score )
+            {
+                best = (int32_t)cpus[i].id;
+                best_score = score;
+            }
+        }
+
+        return best;
+    }
+
+    void unplace()
+    {
+        for( uint32_t i = 0; i < t_cpus.size(); i++ )
+        {
+            if( t_cpus[i] >= 0 )
+                soque_cpus_load[t_cpus[i]]--;
+
+            t_cpus[i] = -1;
+        }
+    }
+
+    // SOQUE_BIND_* over allowed cpus (or the given list), returns workers pinned
+    uint32_t place( uint8_t bind, const uint32_t * list, uint32_t list_count )
+    {
+        std::vector<SOQUE_CPU> cpus;
+        std::vector<uint32_t> spread;
+        uint32_t pinned = 0;
+
+        uint32_t isolated = 0;
+
+        std::lock_guard<std::mutex> sets( soque_sets_lock );
+
+        soque_topology( cpus );
+
+        for( uint32_t i = 0; i < cpus.size(); )
+        {
+            uint8_t keep = list == NULL;
+
+            for( uint32_t j = 0; j < list_count && !keep; j++ )
+                keep = list[j] == cpus[i].id;
+
+            if( keep )
+            {
+                spread.push_back( cpus[i].id );
+                isolated += cpus[i].isolated;
+                i++;
+            }
+            else
+                cpus.erase( cpus.begin() + i );
+        }
+
+        // isolated cpus only on request, or when nothing else is allowed
+        if( isolated != cpus.size() || ( bind & SOQUE_BIND_ISOLATED ) )
+        {
+            for( uint32_t i = 0; i < cpus.size(); )
+            {
+                if( ( ( bind & SOQUE_BIND_ISOLATED ) != 0 ) != ( cpus[i].isolated != 0 ) )
+                    cpus.erase( cpus.begin() + i );
+                else
+                    i++;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock( soque_cpus_lock );
+
+        for( uint32_t i = 0; i < cpus.size(); i++ )
+            if( soque_cpus_load.size() <= cpus[i].id )
+                soque_cpus_load.resize( cpus[i].id + 1 );
+
+        for( uint32_t i = 0; i < threads_count; i++ )
+        {
+            int32_t cpu = -1;
+            uint8_t was_pinned = t_cpus[i] >= 0;
+
+            if( was_pinned )
+                soque_cpus_load[t_cpus[i]]--;
+
+            if( bind & ( SOQUE_BIND_CPUS | SOQUE_BIND_NODES ) )
+                cpu = place_one( cpus, ( bind & SOQUE_BIND_NODES ) ? home_node( i ) : -1, ( bind & SOQUE_BIND_NOSMT ) != 0 );
+
+            // placement stands even if the os refuses the pin (fake topology, offline cpu)
+            if( cpu >= 0 )
+            {
+                soque_cpus_load[cpu]++;
+                pinned += soque_pin( threads[i], (uint32_t *)&cpu, 1 );
+            }
+            else if( was_pinned && spread.size() )
+            {
+                soque_pin( threads[i], &spread[0], (uint32_t)spread.size() );
+            }
+
+            t_cpus[i] = cpu;
+        }
+
+        return pinned;
+    }
+
+    uint8_t init( uint32_t t_count, uint8_t bind, SOQUE_HANDLE * sh, uint32_t sh_count )
+    {
+        std::vector<POOL_QUEUE *> queues;
+
+        memset( (void *)this, 0, sizeof( SOQUE_THREADS ) );
+
+        if( t_count == 0 )
+        {
+            std::vector<SOQUE_CPU> cpus;
+            soque_topology( cpus );
+
+            for( uint32_t i = 0; i < cpus.size(); i++ )
+                if( !cpus[i].isolated )
+                    t_count++;
+
+            if( t_count == 0 )
+                t_count = (uint32_t)cpus.size();
+        }
+
+        threads_count = t_count;
+        threads_sync = threads_count;
+        batch = 16;
+        threshold = 10000;
+        reaction = 100;
+        workers_max = threads_count;
+        t_meters.resize( threads_count );
+#ifdef _DEBUG
+        assert( (uintptr_t)t_meters.data() % CACHELINE_SIZE == 0 );
+#endif
+        t_cpus.resize( threads_count, -1 );
+        t_gens = std::vector<std::atomic<uint32_t>>( threads_count );
+
+        for( uint32_t i = 0; i < threads_count; i++ )
+            t_gens[i] = SOQUE_SET_QUIESCENT;
+
+        for( uint32_t i = 0; i < sh_count; i++ )
+            add_graph( queues, sh[i] );
+
+        publish( queues );
+
+        for( uint32_t i = 0; i < threads_count; i++ )
+            threads.push_back( std::thread( &soque_thread, this, i ) );
+
+        threads.push_back( std::thread( &orchestra_thread, this ) );
+
+        if( bind )
+            place( bind, NULL, 0 );
+
+        return 1;
+    }
+
+
+    static void orchestra_thread( SOQUE_THREADS * sts )
+    {
+        uint32_t count = sts->threads_count;
+        uint32_t i;
+        std::vector<uint64_t> proc_meter_last;
+        std::vector<uint64_t> busy_meter_last;
+        std::vector<uint64_t> awake_meter_last;
+        uint32_t workers_count;
+
+        proc_meter_last.resize( count );
+        busy_meter_last.resize( count );
+        awake_meter_last.resize( count );
+        std::chrono::high_resolution_clock::time_point time_last = std::chrono::high_resolution_clock::now();
+        uint64_t tsc_last = rdtsc();
+
+        for( ; !sts->shutdown.load( std::memory_order_relaxed ); )
+        {
+            std::this_thread::sleep_for( std::chrono::milliseconds( sts->reaction ) );
+            std::chrono::high_resolution_clock::time_point time_now = std::chrono::high_resolution_clock::now();
+            std::chrono::duration<double> time_span = std::chrono::duration_cast<std::chrono::duration<double>>( time_now - time_last );
+            uint64_t tsc_now = rdtsc();
+            uint32_t load = 0;
+            time_last = time_now;
+            sts->tsc_per_us = (uint32_t)( ( tsc_now - tsc_last ) / ( time_span.count() * 1000000 ) );
+            tsc_last = tsc_now;
+
+            workers_count = 0;
+
+            for( i = 0; i < count; i++ )
+            {
+                uint64_t speed_meter = sts->t_meters[i].processed;
+                uint64_t busy_meter = sts->t_meters[i].busy_tsc;
+                uint64_t awake_meter = sts->t_meters[i].awake_tsc;
+                uint32_t speed = (uint32_t)( ( speed_meter - proc_meter_last[i] ) / time_span.count() );
+                uint64_t busy = busy_meter - busy_meter_last[i];
+                uint64_t awake = awake_meter - awake_meter_last[i];
+                 
+                if( speed > sts->threshold || ( workers_count == 0 && speed > sts->threshold / 100 ) )
+                    workers_count++;
+
+                // busy share of the worker's own awake time, parked workers add nothing
+                if( awake > busy )
+                    load += (uint32_t)( busy * 100 / awake );
+                else if( busy )
+                    load += 100;
+
+                proc_meter_last[i] = speed_meter;
+                busy_meter_last[i] = busy_meter;
+                awake_meter_last[i] = awake_meter;
+            }
+
+            if( sts->utilization )
+                workers_count = sts->scale( load );
+
+            if( workers_count < sts->over_homes( sts->workers_min ) )
+                workers_count = sts->over_homes( sts->workers_min );
+
+            if( workers_count > sts->over_homes( sts->workers_max ) )
+                workers_count = sts->over_homes( sts->workers_max );
+
+            if( sts->workers_count.exchange( workers_count ) < workers_count )
+                sts->unpark();
+
+            if( sts->size_max )
+                sts->resize_queues();
+
+            sts->measure_shares();
+
+            sts->lrt.fetch_add( 1, std::memory_order_relaxed );
+        }
+    }
+
+    // proc items each queue got of the pool's since the last round
+    void measure_shares()
+    {
+        std::unique_lock<std::mutex> sets( soque_sets_lock, std::try_to_lock );
+        std::vector<uint64_t> items;
+        uint64_t total = 0;
+
+        if( !sets.owns_lock() )
+            return;
+
+        std::vector<POOL_QUEUE *> & queues = qset.load()->queues;
+
+        for( uint32_t i = 0; i < queues.size(); i++ )
+        {
+            uint64_t now = 0;
+
+            for( uint32_t t = 0; t < threads_count; t++ )
+                now += queues[i]->meters[t].proc_items;
+
+            items.push_back( now - queues[i]->proc_last );
+            queues[i]->proc_last = now;
+            total += items[i];
+        }
+
+        for( uint32_t i = 0; i < queues.size(); i++ )
+            queues[i]->share.store( total ? (uint32_t)( items[i] * 1000 / total ) : 0, std::memory_order_relaxed );
+    }
+
+    // a ring full for a while doubles, one nearly empty for longer halves; a slot queue grows once the
+    // batches in proc are done, the rest wait for the queue to drain; the set stays if attach / detach hold it
+    void resize_queues()
+    {
+        std::unique_lock<std::mutex> sets( soque_sets_lock, std::try_to_lock );
+
+        if( !sets.owns_lock() )
+            return;
+
+        std::vector<POOL_QUEUE *> & queues = qset.load()->queues;
+
+        for( uint32_t i = 0; i < queues.size(); i++ )
+        {
+            POOL_QUEUE * pq = queues[i];
+            SOQUE_HANDLE sh = pq->sh;
+            uint32_t size = sh->ring_size();
+            uint32_t used = sh->used();
+            uint32_t next = 0;
+
+            if( ( sh->q_flags & SOQUE_FLAG_FLOWS ) || sh->q_resize.load( std::memory_order_relaxed ) )
+            {
+                pq->full_rounds = 0;
+                pq->calm_rounds = 0;
+                continue;
+            }
+
+            if( used >= size - size / 4 )
+            {
+                pq->calm_rounds = 0;
+
+                if( ++pq->full_rounds >= SOQUE_RESIZE_GROW && size < size_max )
+                    next = size * 2;
+            }
+            else if( used < size / 8 )
+            {
+                pq->full_rounds = 0;
+
+                if( ++pq->calm_rounds >= SOQUE_RESIZE_SHRINK && size > size_min )
+                    next = size / 2;
+            }
+            else
+            {
+                pq->full_rounds = 0;
+                pq->calm_rounds = 0;
+            }
+
+            // push guard busy: next round
+            if( next && sh->resize( next ) )
+            {
+                pq->full_rounds = 0;
+                pq->calm_rounds = 0;
+            }
+        }
+    }
+
+    void syncstart()
+    {
+        if( --threads_sync == 0 )
+        {
+            soque_unpark( threads_sync );
+            return;
+        }
+
+        for( uint32_t n; ( n = threads_sync ) != 0; )
+            soque_park( threads_sync, n, reaction );
+    }
+
+    uint32_t workers_active()
+    {
+        uint32_t active = soques_count.load( std::memory_order_relaxed ) + workers_count.load( std::memory_order_relaxed );
+
+        return active < threads_count ? active : threads_count;
+    }
+
+    // home workers never park, one per queue while threads last
+    uint32_t workers_homes()
+    {
+        uint32_t count = soques_count.load( std::memory_order_relaxed );
+
+        return threads_count < count ? threads_count : count;
+    }
 
-    void sit_on_cpu( std::thread & thread )
+    // workers over the homes within a limit of all workers
+    uint32_t over_homes( uint32_t workers )
     {
-        static uint32_t n = 0;
+        uint32_t homes = workers_homes();
 
-        if( n == SOQUE_MAX_THREADS )
-            return;
+        return workers > homes ? workers - homes : 0;
+    }
 
-#ifdef _WIN32
+    // workers_count for the awake workers to be busy about utilization percent of their rounds,
+    // load in percent of one worker: over the band grows at once to what the load needs,
+    // under the band drops one worker only if the rest would still stay under it
+    uint32_t scale( uint32_t load )
+    {
+        uint32_t homes = workers_homes();
+        uint32_t active = workers_active();
+        uint32_t target = utilization.load( std::memory_order_relaxed );
 
-        SetThreadAffinityMask( thread.native_handle(), (DWORD_PTR)1 << n );
+        if( load > ( target + SOQUE_SCALE_BAND ) * active )
+            active = ( load + target - 1 ) / target;
+        else if( active > homes && load < ( target - SOQUE_SCALE_BAND ) * ( active - 1 ) )
+            active--;
 
-#elif !defined __CYGWIN__ 
+        return active > homes ? active - homes : 0;
+    }
 
-        cpu_set_t cpuset;
-        CPU_ZERO( &cpuset );
-        CPU_SET( n, &cpuset );
-        pthread_setaffinity_np( thread.native_handle(), sizeof( cpu_set_t ), &cpuset );
+    // partial claim halves the batch, contention or backlog for everyone doubles it,
+    // latency_us caps it by the measured proc cost; the batch moves on only from the one
+    // the worker used, so workers adapting at once change it once
+    void batch_adapt( BATCHING * bc, SOQUE_HANDLE sh, uint32_t batch, uint32_t count, uint32_t retries, uint64_t tsc )
+    {
+        uint64_t cost = tsc / count;
+        uint32_t avg = bc->cost.load( std::memory_order_relaxed );
+        uint32_t limit = batch_max;
+        uint32_t next = batch;
 
-#endif
+        cost = avg ? ( avg * (uint64_t)7 + cost ) / 8 : cost;
+        avg = cost < 0xFFFFFFFF ? (uint32_t)cost : 0xFFFFFFFF;
+        bc->cost.store( avg, std::memory_order_relaxed );
 
-        n++;
+        if( latency_us && tsc_per_us && avg )
+        {
+            uint64_t l = (uint64_t)latency_us * tsc_per_us / avg;
+
+            if( l < limit )
+                limit = (uint32_t)l;
+        }
+
+        if( count < batch )
+            next = batch / 2;
+        else if( retries || sh->proc_backlog() >= batch * workers_active() )
+            next = batch * 2;
+
+        if( next > limit )
+            next = limit;
+
+        if( next < batch_min )
+            next = batch_min;
+
+        if( next != batch )
+            bc->batch.compare_exchange_strong( batch, next, std::memory_order_relaxed );
     }
 
-    uint8_t init( uint32_t t_count, uint8_t bind, SOQUE_HANDLE * sh, uint32_t sh_count )
+    void unpark()
     {
-        memset( this, 0, sizeof( SOQUE_THREADS ) );
-        soques_count = sh_count;
-        threads_count = t_count == 0 ? SOQUE_MAX_THREADS : t_count;
-        threads_sync = threads_count;
-        batch = 16;
-        threshold = 10000;
-        reaction = 100;
-        t_proc_meters.resize( threads_count );
-        q_lrts.resize( threads_count );
+        park_seq++;
+        soque_unpark( park_seq );
+    }
 
-        for( uint32_t i = 0; i < sh_count; i++ )
-            soques_handles.push_back( sh[i] );
+    // one more worker on backlog, without waiting for orchestra
+    void unpark_more()
+    {
+        uint32_t w = workers_count;
 
-        for( uint32_t i = 0; i < threads_count; i++ )
-            threads.push_back( std::thread( &soque_thread, this, i ) );
+        if( w < over_homes( workers_max ) && workers_count.compare_exchange_strong( w, w + 1 ) )
+            unpark();
+    }
 
-        threads.push_back( std::thread( &orchestra_thread, this ) );
+    // until workers_count reaches wake_point or a set other than gen is published
+    void park( uint32_t wake_point, uint32_t gen, WORKER_METERS * wm )
+    {
+        std::chrono::steady_clock::time_point park_start;
 
-        if( bind )
+        for( uint32_t i = 0; i < SOQUE_PARK_SPINS; i++ )
         {
-            for( uint32_t i = 0; i < threads_count; i++ )
-                sit_on_cpu( threads[i] );
+            if( workers_count.load( std::memory_order_relaxed ) >= wake_point || qgen.load( std::memory_order_relaxed ) != gen || shutdown.load( std::memory_order_relaxed ) )
+                return;
+
+            cpu_relax();
         }
 
-        return 1;
-    }
+        park_start = std::chrono::steady_clock::now();
+        parked++;
 
+        for( ;; )
+        {
+            uint32_t seq = park_seq;
 
-    static void orchestra_thread( SOQUE_THREADS * sts )
+            if( workers_count >= wake_point || qgen != gen || shutdown )
+                break;
+
+            soque_park( park_seq, seq, reaction );
+        }
+
+        parked--;
+        wm->parked_us += std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - park_start ).count();
+    }
+
+    // home queues: every queue has at least one worker that never parks serving it first
+    uint8_t home_of( uint32_t thread_id, uint32_t i, uint32_t count )
     {
-        uint32_t count = sts->threads_count;
-        uint32_t i;
-        std::vector<uint32_t> proc_meter_last;
-        uint32_t workers_count;
+        if( threads_count >= count )
+            return i == thread_id % count;
 
-        proc_meter_last.resize( count );
-        std::chrono::high_resolution_clock::time_point time_last = std::chrono::high_resolution_clock::now();
+        return i % threads_count == thread_id;
+    }
+
+    // most backlogged queue out of home, or NULL if none
+    POOL_QUEUE * steal_victim( uint32_t thread_id, QUEUE_SET * set )
+    {
+        POOL_QUEUE * victim = NULL;
+        uint32_t backlog_max = 0;
+        uint32_t count = (uint32_t)set->queues.size();
 
-        for( ; !sts->shutdown; )
+        for( uint32_t i = 0; i < count; i++ )
         {
-            std::this_thread::sleep_for( std::chrono::milliseconds( sts->reaction ) );
-            std::chrono::high_resolution_clock::time_point time_now = std::chrono::high_resolution_clock::now();
-            std::chrono::duration<double> time_span = std::chrono::duration_cast<std::chrono::duration<double>>( time_now - time_last );
-            time_last = time_now;
+            uint32_t backlog;
 
-            workers_count = 0;
+            if( home_of( thread_id, i, count ) )
+                continue;
 
-            for( i = 0; i < count; i++ )
-            {
-                uint32_t speed_meter = sts->t_proc_meters[i];
-                uint32_t speed = (uint32_t)( ( speed_meter - proc_meter_last[i] ) / time_span.count() );
-                 
-                if( speed > sts->threshold || ( workers_count == 0 && speed > sts->threshold / 100 ) )
-                    workers_count++;
+            backlog = set->queues[i]->sh->proc_backlog();
 
-                proc_meter_last[i] = speed_meter;
+            if( backlog > backlog_max )
+            {
+                backlog_max = backlog;
+                victim = set->queues[i];
             }
-
-            sts->workers_count = workers_count;
-            sts->lrt++;
         }
+
+        return victim;
     }
 
-    void syncstart()
+    uint32_t proc( POOL_QUEUE * pq, WORKER_METERS * wm, QUEUE_METERS * qm )
     {
-        threads_sync--;
-        while( threads_sync != 0 )
-            std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+        SOQUE_HANDLE sh = pq->sh;
+        BATCHING * bc = &pq->bc;
+        uint32_t b = batch_max ? bc->batch.load( std::memory_order_relaxed ) : batch;
+        uint32_t stage = sh->stage_last();
+        uint32_t retries;
+        uint64_t tsc;
+        SOQUE_BATCH proc_batch;
+
+        // later stages first, they finish what is in flight while it is still in cache
+        for( ;; )
+        {
+            proc_batch = sh->stage_get( stage, b, &retries );
+            qm->proc_retries += retries;
+
+            if( proc_batch.count || stage == 0 )
+                break;
+
+            stage--;
+        }
+
+        if( proc_batch.count == 0 )
+            return 0;
+
+        if( parked.load( std::memory_order_relaxed ) && proc_batch.count == b && sh->proc_backlog() > b * ( workers_count.load( std::memory_order_relaxed ) + 1 ) )
+            unpark_more();
+
+        tsc = rdtsc();
+        sh->stages[stage].proc_cb( sh->cb_arg, proc_batch );
+        tsc = rdtsc() - tsc;
+        wm->busy_tsc += tsc;
+
+        if( batch_max )
+            batch_adapt( bc, sh, b, proc_batch.count, retries, tsc );
+
+        sh->stage_done( stage, proc_batch );
+
+        wm->processed += proc_batch.count;
+        qm->proc_items += proc_batch.count;
+        return proc_batch.count;
     }
 
-    static void soque_thread( SOQUE_THREADS * sts, uint32_t thread_id )
+    // deficit round-robin: a visit adds weight batches of credit and procs while credit and work last,
+    // a drained queue keeps no credit for later
+    uint32_t serve( POOL_QUEUE * pq, WORKER_METERS * wm, QUEUE_METERS * qm )
     {
-        uint32_t soques_count = sts->soques_count;
-        SOQUE_HANDLE * soques_handles = &sts->soques_handles[0];
-        uint32_t * t_proc_meter = &sts->t_proc_meters[thread_id];
-        uint32_t proc_meter = *t_proc_meter;
-        uint32_t * q_lrts = &sts->q_lrts[0];
-        uint32_t wake_point = thread_id < soques_count ? 0 : thread_id - soques_count + 1;
+        uint32_t done = 0;
 
-        sts->syncstart();
+        qm->deficit += (int64_t)pq->weight.load( std::memory_order_relaxed ) * ( batch_max ? pq->bc.batch.load( std::memory_order_relaxed ) : batch );
 
-        for( uint32_t i = 0; sts->shutdown == 0; )
+        while( qm->deficit > 0 )
         {
-            SOQUE_HANDLE sh = soques_handles[i];
+            uint32_t b = batch_max ? pq->bc.batch.load( std::memory_order_relaxed ) : batch;
+            uint32_t n = proc( pq, wm, qm );
+
+            done += n;
+            qm->deficit -= n;
 
-            // PROC
+            if( n < b )
             {
-                SOQUE_BATCH proc_batch = soque_proc_get( sh, sts->batch );
+                qm->deficit = 0;
+                break;
+            }
+        }
 
-                if( proc_batch.count )
-                {
-                    sh->proc_cb( sh->cb_arg, proc_batch );
+        return done;
+    }
 
-                    soque_proc_done( sh, proc_batch );
+    // waitable for push_cb / pop_cb: with a delay and a measured tsc rate, the oldest item pending since
+    // `since` (stamped now if none) is over the delay; otherwise a reaction period passed since `lrt_last`
+    uint8_t overdue( POOL_QUEUE * pq, uint64_t & since, uint32_t lrt_last, uint64_t & now )
+    {
+        uint64_t delay_tsc = (uint64_t)pq->delay_us.load( std::memory_order_relaxed ) * tsc_per_us;
 
-                    proc_meter += proc_batch.count;
-                    *t_proc_meter = proc_meter;
-                }
-            }
+        if( !delay_tsc )
+            return lrt.load( std::memory_order_relaxed ) - lrt_last > 1;
+
+        now = rdtsc();
+
+        if( !since )
+            since = now;
+
+        return now - since > delay_tsc;
+    }
+
+    // a pop taking all clears the age, one leaving items behind keeps the stamp: the ones left waited
+    // since then at most, so partial pops never push them past the delay unnoticed
+    void popped_since( POOL_QUEUE * pq, uint32_t popped, uint32_t pending, uint64_t now )
+    {
+        if( now && popped && popped == pending )
+            pq->pop_since = 0;
+    }
+
+    uint32_t pop( POOL_QUEUE * pq, QUEUE_METERS * qm )
+    {
+        SOQUE_HANDLE sh = pq->sh;
+        uint64_t now = 0;
+        uint32_t popped = 0;
+
+        if( !sh->pop_cb && !sh->pop_batch_cb && !sh->link )
+            return 0;
+
+        if( !soque_pop_enter( sh ) )
+        {
+            qm->enter_fails++;
+            return 0;
+        }
+
+        if( sh->link )
+        {
+            popped = sh->link_move( sh->ring_size() );
+            qm->pop_calls++;
+        }
+        else if( sh->pop_batch_cb )
+        {
+            SOQUE_BATCH pop_batch = soque_pop_get( sh, sh->ring_size() );
 
-            // POP + PUSH
-            if( soque_pp_enter( sh ) )
+            if( pop_batch.count )
             {
-                // POP
+                popped = sh->pop_batch_cb( sh->cb_arg, pop_batch, overdue( pq, pq->pop_since, pq->pop_lrt, now ) );
+                qm->pop_calls++;
+                qm->pop_yields += popped == 0;
+                popped_since( pq, popped, pop_batch.count, now );
+
+                if( popped )
                 {
-                    uint32_t queued = soque_pop( sh, 0 );
+                    pop_batch.count = popped;
+                    soque_pop_done( sh, pop_batch );
+                }
+            }
+        }
+        else
+        {
+            uint32_t queued = soque_pop( sh, 0 );
 
-                    if( queued )
-                    {
-                        uint32_t popped = sh->pop_cb( sh->cb_arg, queued, sts->lrt - q_lrts[i] > 1 );
+            if( queued )
+            {
+                popped = sh->pop_cb( sh->cb_arg, queued, overdue( pq, pq->pop_since, pq->pop_lrt, now ) );
+                qm->pop_calls++;
+                qm->pop_yields += popped == 0;
+                popped_since( pq, popped, queued, now );
 
-                        if( popped )
-                        {
+                if( popped )
+                {
 #ifdef _DEBUG
-                            assert( popped == soque_pop( sh, popped ) );
+                    assert( popped == soque_pop( sh, popped ) );
 #else
-                            soque_pop( sh, popped );
+                    soque_pop( sh, popped );
 #endif
-                            q_lrts[i] = sts->lrt;
-                        }
-                    }
                 }
+            }
+        }
 
-                // PUSH
-                {
-                    uint32_t available = soque_push( sh, 0 );
+        if( popped )
+        {
+            pq->pop_lrt = lrt.load( std::memory_order_relaxed );
+            qm->pop_items += popped;
+        }
 
-                    if( available )
-                    {
-                        uint32_t pushed = sh->push_cb( sh->cb_arg, available, sts->lrt - q_lrts[i] > 1 );
+        soque_pop_leave( sh );
+
+        return popped;
+    }
+
+    void push( POOL_QUEUE * pq, QUEUE_METERS * qm )
+    {
+        SOQUE_HANDLE sh = pq->sh;
+        uint64_t now = 0;
+        uint32_t available;
+
+        if( !sh->push_cb )
+            return;
+
+        if( !soque_push_enter( sh ) )
+        {
+            qm->enter_fails++;
+            return;
+        }
+
+        available = soque_push( sh, 0 );
 
-                        if( pushed )
-                        {
+        if( available )
+        {
+            uint32_t pushed = sh->push_cb( sh->cb_arg, available, overdue( pq, pq->push_since, pq->push_lrt, now ) );
+
+            qm->push_calls++;
+            qm->push_yields += pushed == 0;
+
+            if( pushed )
+            {
+                qm->push_items += pushed;
 #ifdef _DEBUG
-                            assert( pushed == soque_push( sh, pushed ) );
+                assert( pushed == soque_push( sh, pushed ) );
 #else
-                            soque_push( sh, pushed );
+                soque_push( sh, pushed );
 #endif
-                            q_lrts[i] = sts->lrt;
-                        }
+                pq->push_lrt = lrt.load( std::memory_order_relaxed );
+
+                if( now )
+                    pq->push_since = now;
+            }
+        }
+
+        soque_push_leave( sh );
+    }
+
+    static void soque_thread( SOQUE_THREADS * sts, uint32_t thread_id )
+    {
+        WORKER_METERS * wm = &sts->t_meters[thread_id];
+        QUEUE_SET * set = NULL;
+        uint32_t soques_count = 0;
+        uint32_t wake_point = 0;
+        std::vector<POOL_QUEUE *> homes;
+        uint32_t processed = 0;
+        uint64_t round_tsc;
+        uint64_t tsc;
+
+        sts->syncstart();
+        round_tsc = rdtsc();
+
+        // homes round-robin, proc of the most backlogged foreign queue after an idle round;
+        // queues over the pool's lowest priority class are everyone's homes, rounds go by class
+        for( uint32_t h = 0; sts->shutdown.load( std::memory_order_relaxed ) == 0; )
+        {
+            // attach / detach / priority take effect between rounds
+            if( h == 0 && sts->qset.load( std::memory_order_relaxed ) != set )
+            {
+                uint32_t prio_min = 0xFFFFFFFF;
+
+                set = sts->hold_set( thread_id );
+                soques_count = (uint32_t)set->queues.size();
+                wake_point = thread_id < soques_count ? 0 : thread_id - soques_count + 1;
+                homes.clear();
+
+                for( uint32_t i = 0; i < soques_count; i++ )
+                    if( set->prios[i] < prio_min )
+                        prio_min = set->prios[i];
+
+                // by class, in set order within one
+                for( uint32_t prio = 0xFFFFFFFF, next; ; prio = next )
+                {
+                    next = prio_min;
+
+                    for( uint32_t i = 0; i < soques_count; i++ )
+                    {
+                        if( set->prios[i] == prio && ( prio > prio_min || sts->home_of( thread_id, i, soques_count ) ) )
+                            homes.push_back( set->queues[i] );
+                        else if( set->prios[i] < prio && set->prios[i] > next )
+                            next = set->prios[i];
                     }
+
+                    if( prio == prio_min )
+                        break;
                 }
+            }
+
+            if( h < homes.size() )
+            {
+                POOL_QUEUE * pq = homes[h++];
+                QUEUE_METERS * qm = &pq->meters[thread_id];
 
-                soque_pp_leave( sh );
+                processed += sts->serve( pq, wm, qm );
+                sts->pop( pq, qm );
+                sts->push( pq, qm );
             }
 
-            if( ++i == soques_count )
+            if( h >= homes.size() )
             {
-                i = 0;
+                h = 0;
 
-                if( wake_point )
-                    while( sts->workers_count < wake_point )
-                        std::this_thread::sleep_for( std::chrono::milliseconds( sts->reaction ) );
+                if( processed == 0 && homes.size() < soques_count )
+                {
+                    POOL_QUEUE * victim = sts->steal_victim( thread_id, set );
+
+                    if( victim )
+                        processed = sts->proc( victim, wm, &victim->meters[thread_id] );
+                }
+
+                tsc = rdtsc();
+                wm->awake_tsc += tsc - round_tsc;
+                round_tsc = tsc;
+
+                if( processed == 0 )
+                    wm->idle_loops++;
+
+                processed = 0;
+
+                // a parked worker holds no set, it takes the current one with its wake point and homes on waking
+                if( wake_point && sts->workers_count.load( std::memory_order_relaxed ) < wake_point )
+                {
+                    uint32_t gen = sts->t_gens[thread_id];
+
+                    sts->t_gens[thread_id] = SOQUE_SET_QUIESCENT;
+                    set = NULL;
+                    sts->park( wake_point, gen, wm );
+                    round_tsc = rdtsc();
+                }
             }
         }
+
+        sts->t_gens[thread_id] = SOQUE_SET_QUIESCENT;
     }
 
     void cleanup()
     {
+        QUEUE_SET * set;
+
         shutdown = 1;
+        unpark();
 
-        for( uint32_t i = 0; i < threads_count; i++ )
+        for( uint32_t i = 0; i < threads.size(); i++ )
             threads[i].join();
+
+        if( ( set = qset.exchange( NULL ) ) != NULL )
+        {
+            for( uint32_t i = 0; i < set->queues.size(); i++ )
+                delete set->queues[i];
+
+            delete set;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock( soque_cpus_lock );
+            unplace();
+        }
+
+        // the pool is malloc'ed and freed, never destructed, its vectors give their memory back here
+        std::vector<std::thread>().swap( threads );
+        std::vector<WORKER_METERS, CACHELINE_ALLOCATOR<WORKER_METERS>>().swap( t_meters );
+        std::vector<int32_t>().swap( t_cpus );
+        std::vector<std::atomic<uint32_t>>().swap( t_gens );
     }
 
     ~SOQUE_THREADS()
@@ -593,11 +3303,182 @@ SOQUE_THREADS_HANDLE SOQUE_CALL soque_threads_open( uint32_t threads_count, uint
 
 void SOQUE_CALL soque_threads_tune( SOQUE_THREADS_HANDLE sth, uint32_t batch, uint32_t threshold, uint32_t reaction )
 {
-    sth->batch = batch;
+    if( batch )
+    {
+        sth->batch = batch;
+        sth->batch_max = 0;
+    }
+
     sth->threshold = threshold;
     sth->reaction = reaction;
 }
 
+void SOQUE_CALL soque_threads_batch( SOQUE_THREADS_HANDLE sth, uint32_t batch_min, uint32_t batch_max, uint32_t latency_us )
+{
+    std::lock_guard<std::mutex> lock( soque_sets_lock );
+    std::vector<SOQUE_THREADS::POOL_QUEUE *> & queues = sth->qset.load()->queues;
+
+    if( batch_min == 0 )
+        batch_min = 1;
+
+    if( batch_max < batch_min )
+        batch_max = batch_min;
+
+    sth->batch_min = batch_min;
+    sth->latency_us = latency_us;
+
+    for( uint32_t i = 0; i < queues.size(); i++ )
+        queues[i]->bc.batch.store( batch_min, std::memory_order_relaxed );
+
+    sth->batch_max = batch_max;
+}
+
+void SOQUE_CALL soque_threads_scale( SOQUE_THREADS_HANDLE sth, uint32_t utilization, uint32_t workers_min, uint32_t workers_max )
+{
+    uint32_t over;
+
+    if( utilization && utilization < SOQUE_SCALE_BAND * 2 )
+        utilization = SOQUE_SCALE_BAND * 2;
+
+    if( utilization > 100 - SOQUE_SCALE_BAND * 2 )
+        utilization = 100 - SOQUE_SCALE_BAND * 2;
+
+    if( workers_max == 0 || workers_max > sth->threads_count )
+        workers_max = sth->threads_count;
+
+    if( workers_min > workers_max )
+        workers_min = workers_max;
+
+    // limits count all workers, the homes among them change with attach / detach
+    sth->workers_min = workers_min;
+    sth->workers_max = workers_max;
+    sth->utilization = utilization;
+    over = sth->over_homes( workers_max );
+
+    if( sth->workers_count.load( std::memory_order_relaxed ) > over )
+        sth->workers_count = over;
+}
+
+void SOQUE_CALL soque_threads_resize( SOQUE_THREADS_HANDLE sth, uint32_t size_min, uint32_t size_max )
+{
+    // powers of two down
+    while( size_min & ( size_min - 1 ) )
+        size_min &= size_min - 1;
+
+    while( size_max & ( size_max - 1 ) )
+        size_max &= size_max - 1;
+
+    if( size_max > SOQUE_RUN_FROZEN / 2 )
+        size_max = SOQUE_RUN_FROZEN / 2;
+
+    if( size_min < 2 )
+        size_min = 2;
+
+    if( size_max && size_max < size_min )
+        size_max = size_min;
+
+    sth->size_min = size_min;
+    sth->size_max = size_max;
+}
+
+uint32_t SOQUE_CALL soque_threads_stats( SOQUE_THREADS_HANDLE sth, SOQUE_WORKER_STATS * workers, SOQUE_STATS * queues )
+{
+    if( workers )
+    {
+        for( uint32_t t = 0; t < sth->threads_count; t++ )
+        {
+            SOQUE_THREADS::WORKER_METERS * wm = &sth->t_meters[t];
+
+            workers[t].processed = wm->processed;
+            workers[t].idle_loops = wm->idle_loops;
+            workers[t].parked_us = wm->parked_us;
+            workers[t].cpu = sth->t_cpus[t];
+        }
+    }
+
+    if( queues )
+    {
+        std::lock_guard<std::mutex> lock( soque_sets_lock );
+        std::vector<SOQUE_THREADS::POOL_QUEUE *> & pqs = sth->qset.load()->queues;
+
+        for( uint32_t i = 0; i < pqs.size(); i++ )
+        {
+            SOQUE_STATS * st = &queues[i];
+
+            pqs[i]->sh->stats( st );
+
+            for( uint32_t t = 0; t < sth->threads_count; t++ )
+            {
+                SOQUE_THREADS::QUEUE_METERS * qm = &pqs[i]->meters[t];
+
+                st->enter_fails += qm->enter_fails;
+                st->proc_retries += qm->proc_retries;
+                st->push_calls += qm->push_calls;
+                st->push_items += qm->push_items;
+                st->pop_calls += qm->pop_calls;
+                st->pop_items += qm->pop_items;
+                st->push_yields += qm->push_yields;
+                st->pop_yields += qm->pop_yields;
+            }
+        }
+    }
+
+    return sth->threads_count;
+}
+
+uint8_t SOQUE_CALL soque_threads_delay( SOQUE_THREADS_HANDLE sth, SOQUE_HANDLE sh, uint32_t delay_us )
+{
+    std::lock_guard<std::mutex> lock( soque_sets_lock );
+
+    return sth->delay( sh, delay_us );
+}
+
+uint8_t SOQUE_CALL soque_threads_priority( SOQUE_THREADS_HANDLE sth, SOQUE_HANDLE sh, uint32_t prio, uint32_t weight )
+{
+    std::lock_guard<std::mutex> lock( soque_sets_lock );
+
+    return sth->priority( sh, prio, weight );
+}
+
+uint32_t SOQUE_CALL soque_threads_shares( SOQUE_THREADS_HANDLE sth, SOQUE_SHARE * shares )
+{
+    std::lock_guard<std::mutex> lock( soque_sets_lock );
+    std::vector<SOQUE_THREADS::POOL_QUEUE *> & pqs = sth->qset.load()->queues;
+
+    for( uint32_t i = 0; shares && i < pqs.size(); i++ )
+    {
+        shares[i].proc_items = 0;
+
+        for( uint32_t t = 0; t < sth->threads_count; t++ )
+            shares[i].proc_items += pqs[i]->meters[t].proc_items;
+
+        shares[i].share = pqs[i]->share.load( std::memory_order_relaxed );
+        shares[i].prio = pqs[i]->prio;
+        shares[i].weight = pqs[i]->weight;
+    }
+
+    return (uint32_t)pqs.size();
+}
+
+uint8_t SOQUE_CALL soque_threads_attach( SOQUE_THREADS_HANDLE sth, SOQUE_HANDLE sh )
+{
+    std::lock_guard<std::mutex> lock( soque_sets_lock );
+
+    return sth->attach( sh );
+}
+
+uint32_t SOQUE_CALL soque_threads_detach( SOQUE_THREADS_HANDLE sth, SOQUE_HANDLE sh, uint8_t drain )
+{
+    std::lock_guard<std::mutex> lock( soque_sets_lock );
+
+    return sth->detach( sh, drain );
+}
+
+uint32_t SOQUE_CALL soque_threads_bind( SOQUE_THREADS_HANDLE sth, uint8_t bind, const uint32_t * cpus, uint32_t cpus_count )
+{
+    return sth->place( bind, cpus, cpus_count );
+}
+
 void SOQUE_CALL soque_threads_close( SOQUE_THREADS_HANDLE sth )
 {
     sth->cleanup();
@@ -620,6 +3501,39 @@ const SOQUE_FRAMEWORK * soque_framework()
         soque_threads_open,
         soque_threads_tune,
         soque_threads_close,
+        soque_open_ex,
+        soque_push_reserve,
+        soque_push_commit,
+        soque_pop_enter,
+        soque_pop_leave,
+        soque_push_enter,
+        soque_push_leave,
+        soque_event_fd,
+        soque_open_flows,
+        soque_flow_keys,
+        soque_pop_get,
+        soque_pop_done,
+        soque_threads_batch,
+        soque_node,
+        soque_threads_bind,
+        soque_stats,
+        soque_threads_stats,
+        soque_latency,
+        soque_threads_scale,
+        soque_threads_attach,
+        soque_threads_detach,
+        soque_resize,
+        soque_threads_resize,
+        soque_open_slots,
+        soque_slot,
+        soque_open_stages,
+        soque_stage_get,
+        soque_stage_done,
+        soque_link,
+        soque_link_move,
+        soque_threads_priority,
+        soque_threads_shares,
+        soque_threads_delay,
     };
 
     return &soq;
@@ -2,7 +2,7 @@
 #define SOQUE_H
 
 #define SOQUE_MAJOR 1
-#define SOQUE_MINOR 0
+#define SOQUE_MINOR 18
 
 #ifdef __cplusplus
 extern "C" {
@@ -23,31 +23,166 @@ extern "C" {
 #endif // _WIN32
 #define SOQUE_GET_FRAMEWORK "soque_framework"
 
+// soque_open_ex flags
+#define SOQUE_FLAG_RANGES 0x00000001 // proc_done records a batch once, pop retires whole batches
+#define SOQUE_FLAG_FLOWS 0x00000002 // order within a flow key only, see soque_open_flows
+#define SOQUE_FLAG_HUGE 0x00000004 // queue memory on huge pages where the system has them, plain pages otherwise
+#define SOQUE_FLAG_NODE_SHIFT 24
+#define SOQUE_FLAG_NODE_MASK 0xFF000000
+#define SOQUE_FLAG_NODE( node ) ( (uint32_t)( ( node ) + 1 ) << SOQUE_FLAG_NODE_SHIFT ) // queue memory on numa node 0..254
+
+// soque_open_stages stages
+#define SOQUE_STAGES_MAX 8
+
+// soque_threads_priority weight, proc batches a queue gets per visit
+#define SOQUE_WEIGHT_MAX 1024
+
+// soque_open_slots slots start on a cache line of this size
+#define SOQUE_SLOT_LINE 64
+
+// soque_threads_open / soque_threads_bind bind
+#define SOQUE_BIND_CPUS 0x01 // a cpu per worker, least used by all pools first, smt siblings last
+#define SOQUE_BIND_NODES 0x02 // a cpu on the numa node of the worker's home queues
+#define SOQUE_BIND_NOSMT 0x04 // never share a core, workers left over stay unbound
+#define SOQUE_BIND_ISOLATED 0x08 // isolated cpus only, they are skipped otherwise
+
+// soque_event_fd events, fd is readable once per transition, read it to clear
+#define SOQUE_EVENT_POP 0 // processed slots are ready to pop (after soque_pop found none); flows: a slot done near the head, its flow may still hold it back
+#define SOQUE_EVENT_PUSH 1 // free slots reached watermark (after soque_push found less)
+
+// soque_latency kinds, tsc per slot, libsoque built with SOQUE_LATENCY
+#define SOQUE_LATENCY_TOTAL 0 // push_commit to pop
+#define SOQUE_LATENCY_WAIT 1 // push_commit to proc_get
+#define SOQUE_LATENCY_PROC 2 // proc_get to proc_done
+#define SOQUE_LATENCY_ORDER 3 // proc_done to pop, the price of strict order
+#define SOQUE_LATENCY_KINDS 4
+
+// log-linear buckets: exact below 2^SUB_BITS, then 2^SUB_BITS buckets per power of 2
+#define SOQUE_LATENCY_SUB_BITS 3
+#define SOQUE_LATENCY_BUCKETS ( ( 64 - SOQUE_LATENCY_SUB_BITS + 1 ) << SOQUE_LATENCY_SUB_BITS )
+
+    // lowest tsc value counted in a bucket
+    static inline uint64_t soque_latency_floor( uint32_t bucket )
+    {
+        uint32_t sub = 1 << SOQUE_LATENCY_SUB_BITS;
+
+        if( bucket < sub )
+            return bucket;
+
+        return (uint64_t)( sub + bucket % sub ) << ( bucket / sub - 1 );
+    }
+
+    // slot_size up to a power of 2 within a cache line, to whole lines past it, so small slots
+    // never straddle a line; slot i is at soque_slot( sh, 0 ) + i * stride
+    static inline uint32_t soque_slot_stride( uint32_t slot_size )
+    {
+        uint32_t stride = 1;
+
+        if( slot_size > SOQUE_SLOT_LINE )
+            return ( slot_size + SOQUE_SLOT_LINE - 1 ) & ~( SOQUE_SLOT_LINE - 1 );
+
+        while( stride < slot_size )
+            stride <<= 1;
+
+        return stride;
+    }
+
     typedef struct
     {
         uint32_t index;
         uint32_t count;
     } SOQUE_BATCH;
 
+    // racy snapshot of a queue, counters are filled by soque_threads_stats for pool workers
+    typedef struct
+    {
+        uint32_t size;
+        uint32_t free;
+        uint32_t reserved; // push_reserve'd, not committed
+        uint32_t filled; // pushed, not taken by proc_get
+        uint32_t in_proc; // taken by proc_get, not processed (ranges: also done behind an unfinished batch)
+        uint32_t processed; // processed, not popped
+        uint64_t enter_fails; // pop / push guard held by someone else
+        uint64_t proc_retries; // proc_get lost a race for q_proc_run
+        uint64_t push_calls;
+        uint64_t push_items;
+        uint64_t pop_calls;
+        uint64_t pop_items;
+        uint64_t push_yields; // push_cb returned 0
+        uint64_t pop_yields; // pop_cb / pop_batch_cb returned 0
+    } SOQUE_STATS;
+
+    // proc service a pool gave a queue
+    typedef struct
+    {
+        uint64_t proc_items; // by pool workers since attach
+        uint32_t share; // per mille of the pool's proc items over the last orchestra period
+        uint32_t prio;
+        uint32_t weight;
+    } SOQUE_SHARE;
+
+    typedef struct
+    {
+        uint64_t processed;
+        uint64_t idle_loops; // rounds without proc work at home or stolen
+        uint64_t parked_us;
+        int32_t cpu; // -1 unbound
+    } SOQUE_WORKER_STATS;
+
     typedef uint32_t ( SOQUE_CALL * soque_push_cb )( void * cb_arg, uint32_t batch, uint8_t waitable );
     typedef void ( SOQUE_CALL * soque_proc_cb )( void * cb_arg, SOQUE_BATCH );
     typedef uint32_t ( SOQUE_CALL * soque_pop_cb )( void * cb_arg, uint32_t batch, uint8_t waitable );
+    typedef uint32_t ( SOQUE_CALL * soque_pop_batch_cb )( void * cb_arg, SOQUE_BATCH, uint8_t waitable );
+    typedef uint32_t ( SOQUE_CALL * soque_route_cb )( void * cb_arg, void * slot ); // index into soque_link to, past it = dropped
 
     typedef struct SOQUE * SOQUE_HANDLE;
 
     typedef SOQUE_HANDLE ( SOQUE_CALL * soque_open_t )( uint32_t size, void * cb_arg, soque_push_cb, soque_proc_cb, soque_pop_cb );
+    typedef SOQUE_HANDLE ( SOQUE_CALL * soque_open_ex_t )( uint32_t size, uint32_t flags, void * cb_arg, soque_push_cb, soque_proc_cb, soque_pop_cb );
+    typedef SOQUE_HANDLE ( SOQUE_CALL * soque_open_flows_t )( uint32_t size, uint32_t flags, void * cb_arg, soque_push_cb, soque_proc_cb, soque_pop_batch_cb );
+    typedef uint32_t * ( SOQUE_CALL * soque_flow_keys_t )( SOQUE_HANDLE );
     typedef uint8_t ( SOQUE_CALL * soque_pp_enter_t )( SOQUE_HANDLE );
     typedef uint32_t ( SOQUE_CALL * soque_push_t )( SOQUE_HANDLE, uint32_t batch );
+    typedef SOQUE_BATCH ( SOQUE_CALL * soque_push_reserve_t )( SOQUE_HANDLE, uint32_t batch );
+    typedef void ( SOQUE_CALL * soque_push_commit_t )( SOQUE_HANDLE, SOQUE_BATCH );
     typedef SOQUE_BATCH ( SOQUE_CALL * soque_proc_get_t )( SOQUE_HANDLE, uint32_t batch );
     typedef void ( SOQUE_CALL * soque_proc_done_t )( SOQUE_HANDLE, SOQUE_BATCH );
     typedef uint32_t ( SOQUE_CALL * soque_pop_t )( SOQUE_HANDLE, uint32_t batch );
+    typedef SOQUE_BATCH ( SOQUE_CALL * soque_pop_get_t )( SOQUE_HANDLE, uint32_t batch );
+    typedef void ( SOQUE_CALL * soque_pop_done_t )( SOQUE_HANDLE, SOQUE_BATCH );
     typedef void ( SOQUE_CALL * soque_pp_leave_t )( SOQUE_HANDLE );
+    typedef uint8_t ( SOQUE_CALL * soque_pop_enter_t )( SOQUE_HANDLE );
+    typedef void ( SOQUE_CALL * soque_pop_leave_t )( SOQUE_HANDLE );
+    typedef uint8_t ( SOQUE_CALL * soque_push_enter_t )( SOQUE_HANDLE );
+    typedef void ( SOQUE_CALL * soque_push_leave_t )( SOQUE_HANDLE );
     typedef void ( SOQUE_CALL * soque_close_t )( SOQUE_HANDLE );
+    typedef int ( SOQUE_CALL * soque_event_fd_t )( SOQUE_HANDLE, uint32_t event, uint32_t watermark );
+    typedef int32_t ( SOQUE_CALL * soque_node_t )( SOQUE_HANDLE );
+    typedef void ( SOQUE_CALL * soque_stats_t )( SOQUE_HANDLE, SOQUE_STATS * );
+    typedef uint32_t ( SOQUE_CALL * soque_latency_t )( SOQUE_HANDLE, uint32_t kind, uint64_t * buckets, uint8_t reset );
+    typedef uint32_t ( SOQUE_CALL * soque_resize_t )( SOQUE_HANDLE, uint32_t size );
+    typedef SOQUE_HANDLE ( SOQUE_CALL * soque_open_slots_t )( uint32_t size, uint32_t slot_size, uint32_t flags, void * cb_arg, soque_push_cb, soque_proc_cb, soque_pop_cb );
+    typedef void * ( SOQUE_CALL * soque_slot_t )( SOQUE_HANDLE, uint32_t index );
+    typedef SOQUE_HANDLE ( SOQUE_CALL * soque_open_stages_t )( uint32_t size, uint32_t slot_size, uint32_t stages, uint32_t flags, void * cb_arg, soque_push_cb, const soque_proc_cb * proc_cbs, soque_pop_cb );
+    typedef SOQUE_BATCH ( SOQUE_CALL * soque_stage_get_t )( SOQUE_HANDLE, uint32_t stage, uint32_t batch );
+    typedef void ( SOQUE_CALL * soque_stage_done_t )( SOQUE_HANDLE, uint32_t stage, SOQUE_BATCH );
+    typedef uint8_t ( SOQUE_CALL * soque_link_t )( SOQUE_HANDLE, const SOQUE_HANDLE * to, uint32_t to_count, soque_route_cb route );
+    typedef uint32_t ( SOQUE_CALL * soque_link_move_t )( SOQUE_HANDLE, uint32_t batch );
 
     typedef struct SOQUE_THREADS * SOQUE_THREADS_HANDLE;
 
     typedef SOQUE_THREADS_HANDLE ( SOQUE_CALL * soque_threads_open_t )( uint32_t threads, uint8_t bind, SOQUE_HANDLE * shs, uint32_t shs_count );
     typedef void ( SOQUE_CALL * soque_threads_tune_t )( SOQUE_THREADS_HANDLE, uint32_t batch, uint32_t threshold, uint32_t reaction );
+    typedef void ( SOQUE_CALL * soque_threads_batch_t )( SOQUE_THREADS_HANDLE, uint32_t batch_min, uint32_t batch_max, uint32_t latency_us );
+    typedef uint32_t ( SOQUE_CALL * soque_threads_bind_t )( SOQUE_THREADS_HANDLE, uint8_t bind, const uint32_t * cpus, uint32_t cpus_count );
+    typedef uint32_t ( SOQUE_CALL * soque_threads_stats_t )( SOQUE_THREADS_HANDLE, SOQUE_WORKER_STATS * workers, SOQUE_STATS * queues );
+    typedef void ( SOQUE_CALL * soque_threads_scale_t )( SOQUE_THREADS_HANDLE, uint32_t utilization, uint32_t workers_min, uint32_t workers_max );
+    typedef uint8_t ( SOQUE_CALL * soque_threads_attach_t )( SOQUE_THREADS_HANDLE, SOQUE_HANDLE );
+    typedef uint32_t ( SOQUE_CALL * soque_threads_detach_t )( SOQUE_THREADS_HANDLE, SOQUE_HANDLE, uint8_t drain );
+    typedef void ( SOQUE_CALL * soque_threads_resize_t )( SOQUE_THREADS_HANDLE, uint32_t size_min, uint32_t size_max );
+    typedef uint8_t ( SOQUE_CALL * soque_threads_priority_t )( SOQUE_THREADS_HANDLE, SOQUE_HANDLE, uint32_t prio, uint32_t weight );
+    typedef uint32_t ( SOQUE_CALL * soque_threads_shares_t )( SOQUE_THREADS_HANDLE, SOQUE_SHARE * shares );
+    typedef uint8_t ( SOQUE_CALL * soque_threads_delay_t )( SOQUE_THREADS_HANDLE, SOQUE_HANDLE, uint32_t delay_us );
     typedef void ( SOQUE_CALL * soque_threads_close_t )( SOQUE_THREADS_HANDLE );
 
     typedef struct {
@@ -64,6 +199,39 @@ extern "C" {
         soque_threads_open_t soque_threads_open;
         soque_threads_tune_t soque_threads_tune;
         soque_threads_close_t soque_threads_close;
+        soque_open_ex_t soque_open_ex;
+        soque_push_reserve_t soque_push_reserve; // any thread, push_cb = NULL in soque_open
+        soque_push_commit_t soque_push_commit;
+        soque_pop_enter_t soque_pop_enter; // pop owner, independent of push owner
+        soque_pop_leave_t soque_pop_leave;
+        soque_push_enter_t soque_push_enter; // push owner, independent of pop owner
+        soque_push_leave_t soque_push_leave;
+        soque_event_fd_t soque_event_fd; // linux eventfd, -1 elsewhere
+        soque_open_flows_t soque_open_flows; // pop releases a slot once earlier slots of its flow key are popped
+        soque_flow_keys_t soque_flow_keys; // flow key of slot i, set before push commit
+        soque_pop_get_t soque_pop_get; // next run of poppable slots, one at a time
+        soque_pop_done_t soque_pop_done;
+        soque_threads_batch_t soque_threads_batch; // adaptive proc batch, soque_threads_tune with batch != 0 fixes it again
+        soque_node_t soque_node; // numa node the queue memory is on, which SOQUE_FLAG_NODE only prefers; -1 unknown
+        soque_threads_bind_t soque_threads_bind; // re-place workers, cpus = NULL for all allowed, returns workers pinned
+        soque_stats_t soque_stats; // queue occupancy
+        soque_threads_stats_t soque_threads_stats; // workers[threads], queues[attached, in attach order] or NULL, returns threads
+        soque_latency_t soque_latency; // copies SOQUE_LATENCY_BUCKETS counters, 0 = built without SOQUE_LATENCY
+        soque_threads_scale_t soque_threads_scale; // wake workers by busy time, utilization % ( 0 = by threshold ), workers_max 0 = all threads
+        soque_threads_attach_t soque_threads_attach; // serve one more queue, 0 = already attached
+        soque_threads_detach_t soque_threads_detach; // not from pool callbacks, returns once no worker is in the queue, drain = proc and pop the rest here; slots in use, -1 = not attached
+        soque_resize_t soque_resize; // not under the push guard, waits for a push step holding it; pushes find no room until the switch, producers retry: a slot queue of one stage growing switches once the batches in proc are done, pending slots move to 0.., index queues and shrinks wait for the queue to drain, then slots restart at 0; size 0 = no change, returns ring size, 0 = refused (flows, not a power of 2)
+        soque_threads_resize_t soque_threads_resize; // ring sizes follow occupancy, doubling up to size_max or halving down to size_min, as soque_resize stalls pushes until the switch; size_max 0 = off
+        soque_open_slots_t soque_open_slots; // soque_open_ex with a zeroed slot_size payload per slot in the queue's own memory
+        soque_slot_t soque_slot; // slot of a held index: push reserved, proc got or pop found; a resize moves the slots, NULL = no slots
+        soque_open_stages_t soque_open_stages; // slots pass proc_cbs[0..stages) in order, each stage claims in parallel, pop after the last; slot_size 0 = no slots, not with ranges or flows
+        soque_stage_get_t soque_stage_get; // soque_proc_get of a stage, stage 0 is soque_proc_get
+        soque_stage_done_t soque_stage_done;
+        soque_link_t soque_link; // popped slots move on to to[route( cb_arg, slot )] in order, route NULL = to[0]; a full destination holds them back; slot queues, no flows, no cycles; destinations without push_cb, slots no smaller, each slot is copied over, not handed by reference; before the queues serve a pool, to_count 0 = unlink
+        soque_link_move_t soque_link_move; // soque_pop of a linked queue, pop owner; returns slots moved or dropped; a pool attaching a queue serves its downstream too
+        soque_threads_priority_t soque_threads_priority; // while attached: higher prio classes come first in every worker's round and any worker serves them, weight 1..SOQUE_WEIGHT_MAX proc batches per visit; default 0, 1; 0 = not attached
+        soque_threads_shares_t soque_threads_shares; // shares[attached, in attach order] or NULL, returns queues
+        soque_threads_delay_t soque_threads_delay; // while attached: pop_cb waitable once the oldest slot it left is delay_us old, push_cb once delay_us passed since its last push, by tsc; 0 = after a reaction period without pops / pushes (default); 0 = not attached
     } SOQUE_FRAMEWORK;
 
     typedef SOQUE_FRAMEWORK * ( * soque_framework_t )();
@@ -0,0 +1,472 @@
+#ifndef SOQUE_HPP
+#define SOQUE_HPP
+
+// header-only soque for C++11: ring size, slot type and callbacks are known at compile time, so the
+// proc loop, ring arithmetic and marker updates inline into the caller; same protocol as libsoque
+// (push in reservation order, proc claims and finishes in any order, pop in order by the pop owner),
+// without resize, flows, ranges, stages or the pool's scaling and binding; soque.h stays the ABI
+// for dynamic loading
+
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <tuple>
+#include <vector>
+#include <type_traits>
+#include <new>
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace soque
+{
+    static const uint32_t cacheline = 64;
+
+    inline uint32_t ctz64( uint64_t v )
+    {
+#ifdef _MSC_VER
+        unsigned long r;
+#ifdef _M_IX86
+        if( _BitScanForward( &r, (uint32_t)v ) )
+            return r;
+        _BitScanForward( &r, (uint32_t)( v >> 32 ) );
+        return r + 32;
+#else
+        _BitScanForward64( &r, v );
+        return r;
+#endif
+#else
+        return (uint32_t)__builtin_ctzll( v );
+#endif
+    }
+
+    // index runs free over uint32_t, slot of it is queue[index]
+    struct batch
+    {
+        uint32_t index;
+        uint32_t count;
+    };
+
+    // no callback for that side
+    struct none
+    {
+    };
+
+    // Size slots of Slot inline, its members aligned to cache lines: new honours that from C++17 only, so
+    // give it static storage, or construct it with placement new in memory aligned to soque::cacheline
+    template<typename Slot, uint32_t Size>
+    class queue
+    {
+        static_assert( Size >= 2 && ( Size & ( Size - 1 ) ) == 0, "soque::queue Size is a power of 2" );
+
+        static const uint32_t mask = Size - 1;
+        static const uint32_t bits = 64;
+        static const uint32_t words = ( Size + bits - 1 ) / bits;
+
+    public:
+        typedef Slot slot_type;
+        static const uint32_t size = Size;
+
+        queue() : push_guard( false ), pop_guard( false ), push_run( 0 ), push_max( 0 ), proc_run( 0 ), pop_here( 0 ), proc_here( 0 )
+        {
+            for( uint32_t i = 0; i < words; i++ )
+                markers[i].store( 0, std::memory_order_relaxed );
+        }
+
+        Slot & operator[]( uint32_t index )
+        {
+            return slots[index & mask];
+        }
+
+        // slots reserved or not popped yet
+        uint32_t used() const
+        {
+            return push_run.load( std::memory_order_relaxed ) - pop_here.load( std::memory_order_relaxed );
+        }
+
+        bool push_enter()
+        {
+            return enter( push_guard );
+        }
+
+        void push_leave()
+        {
+            push_guard.store( false, std::memory_order_release );
+        }
+
+        bool pop_enter()
+        {
+            return enter( pop_guard );
+        }
+
+        void pop_leave()
+        {
+            pop_guard.store( false, std::memory_order_release );
+        }
+
+        // any thread, commit in any order, published in reservation order
+        batch push_reserve( uint32_t count )
+        {
+            uint32_t run = push_run.load( std::memory_order_acquire );
+            batch b;
+
+            do
+            {
+                uint32_t room = Size - ( run - pop_here.load( std::memory_order_acquire ) );
+
+                b.index = run;
+                b.count = count < room ? count : room;
+
+                if( b.count == 0 )
+                    return b;
+            }
+            while( !push_run.compare_exchange_weak( run, run + b.count, std::memory_order_acq_rel, std::memory_order_acquire ) );
+
+            return b;
+        }
+
+        void push_commit( batch b )
+        {
+            if( b.count == 0 )
+                return;
+
+            while( push_max.load( std::memory_order_acquire ) != b.index )
+                std::this_thread::yield();
+
+            push_max.store( b.index + b.count, std::memory_order_release );
+        }
+
+        // push owner of a queue without push_reserve producers: fill up to count free slots while push( slot ) is true
+        template<typename Push>
+        uint32_t push( uint32_t count, Push && cb )
+        {
+            uint32_t run = push_run.load( std::memory_order_relaxed );
+            uint32_t room = Size - ( run - pop_here.load( std::memory_order_acquire ) );
+            uint32_t n = 0;
+
+            if( count > room )
+                count = room;
+
+            while( n < count && cb( slots[( run + n ) & mask] ) )
+                n++;
+
+            if( n )
+            {
+                push_run.store( run + n, std::memory_order_relaxed );
+                push_max.store( run + n, std::memory_order_release );
+            }
+
+            return n;
+        }
+
+        // any thread
+        batch proc_get( uint32_t count )
+        {
+            uint32_t run = proc_run.load( std::memory_order_acquire );
+            batch b;
+
+            do
+            {
+                uint32_t filled = push_max.load( std::memory_order_acquire ) - run;
+
+                b.index = run;
+                b.count = count < filled ? count : filled;
+
+                if( b.count == 0 )
+                    return b;
+            }
+            while( !proc_run.compare_exchange_weak( run, run + b.count, std::memory_order_acq_rel, std::memory_order_acquire ) );
+
+            return b;
+        }
+
+        void proc_done( batch b )
+        {
+            uint32_t i = b.index & mask;
+            uint32_t c = b.count;
+
+            while( c )
+            {
+                uint32_t n = chunk( i, c );
+
+                markers[i / bits].fetch_or( word_mask( i % bits, n ), std::memory_order_release );
+
+                c -= n;
+                i = ( i + n ) & mask;
+            }
+        }
+
+        // any thread: proc( slot ) on up to count claimed slots
+        template<typename Proc>
+        uint32_t proc( uint32_t count, Proc && cb )
+        {
+            batch b = proc_get( count );
+
+            for( uint32_t c = 0; c < b.count; c++ )
+                cb( slots[( b.index + c ) & mask] );
+
+            proc_done( b );
+
+            return b.count;
+        }
+
+        // pop owner: processed slots in push order
+        batch pop_get( uint32_t count )
+        {
+            uint32_t done = retire() - pop_here.load( std::memory_order_relaxed );
+            batch b;
+
+            b.index = pop_here.load( std::memory_order_relaxed );
+            b.count = count < done ? count : done;
+
+            return b;
+        }
+
+        void pop_done( batch b )
+        {
+            if( b.count )
+                pop_here.store( b.index + b.count, std::memory_order_release );
+        }
+
+        // pop owner: up to count slots while pop( slot ) is true, the rest stays queued
+        template<typename Pop>
+        uint32_t pop( uint32_t count, Pop && cb )
+        {
+            batch b = pop_get( count );
+            uint32_t n = 0;
+
+            while( n < b.count && cb( slots[( b.index + n ) & mask] ) )
+                n++;
+
+            b.count = n;
+            pop_done( b );
+
+            return n;
+        }
+
+    private:
+        static bool enter( std::atomic<bool> & guard )
+        {
+            bool f = false;
+
+            return !guard.load( std::memory_order_relaxed ) && guard.compare_exchange_weak( f, true, std::memory_order_acquire, std::memory_order_relaxed );
+        }
+
+        static uint32_t chunk( uint32_t i, uint32_t c )
+        {
+            uint32_t n = bits - i % bits;
+
+            if( n > Size - i )
+                n = Size - i;
+
+            return c < n ? c : n;
+        }
+
+        static uint64_t word_mask( uint32_t bit, uint32_t n )
+        {
+            return ( n == bits ? ~(uint64_t)0 : ( ( (uint64_t)1 << n ) - 1 ) ) << bit;
+        }
+
+        // advance proc_here over the processed prefix, its markers are cleared before pop hands the slots back
+        uint32_t retire()
+        {
+            uint32_t head = proc_here;
+            uint32_t c = push_max.load( std::memory_order_acquire ) - head;
+            uint32_t i = head & mask;
+            uint32_t r = 0;
+
+            while( c )
+            {
+                uint32_t n = chunk( i, c );
+                uint64_t m = word_mask( i % bits, n );
+                uint64_t todo = ~markers[i / bits].load( std::memory_order_acquire ) & m;
+
+                if( todo )
+                    n = ctz64( todo ) - i % bits;
+
+                if( n )
+                    markers[i / bits].fetch_and( ~word_mask( i % bits, n ), std::memory_order_relaxed );
+
+                r += n;
+
+                if( todo )
+                    break;
+
+                c -= n;
+                i = ( i + n ) & mask;
+            }
+
+            return proc_here = head + r;
+        }
+
+        alignas( cacheline ) std::atomic<bool> push_guard;
+        alignas( cacheline ) std::atomic<bool> pop_guard;
+        alignas( cacheline ) std::atomic<uint32_t> push_run;
+        alignas( cacheline ) std::atomic<uint32_t> push_max;
+        alignas( cacheline ) std::atomic<uint32_t> proc_run;
+        alignas( cacheline ) std::atomic<uint32_t> pop_here;
+        uint32_t proc_here; // pop owner only
+        alignas( cacheline ) std::atomic<uint64_t> markers[words];
+        alignas( cacheline ) Slot slots[Size];
+    };
+
+    // a queue with its callbacks for a pool: push( slot ) -> bool under the push guard, proc( slot ) by any
+    // worker, pop( slot ) -> bool under the pop guard; soque::none for a side nobody serves
+    template<typename Queue, typename Push, typename Proc, typename Pop>
+    struct node
+    {
+        Queue & q;
+        Push push;
+        Proc proc;
+        Pop pop;
+        uint32_t batch;
+    };
+
+    template<typename Queue, typename Push, typename Proc, typename Pop>
+    node<Queue, Push, Proc, Pop> make_node( Queue & q, Push push, Proc proc, Pop pop, uint32_t batch = 16 )
+    {
+        node<Queue, Push, Proc, Pop> n = { q, push, proc, pop, batch };
+        return n;
+    }
+
+    // workers go over every node in turn, pushing, processing and popping what they can, yield once a
+    // round finds nothing; the nodes are part of the pool's type, so a round inlines into one loop
+    template<typename... Nodes>
+    class pool
+    {
+    public:
+        pool( uint32_t threads, Nodes... ns ) : stop( false ), nodes( ns... )
+        {
+            if( threads == 0 )
+                threads = std::thread::hardware_concurrency() ? std::thread::hardware_concurrency() : 1;
+
+            // the pool itself is on the heap, so the meters are lined up by hand
+            meters_mem.reset( new uint8_t[( threads + 1 ) * cacheline] );
+            meters = (meter *)( ( (uintptr_t)meters_mem.get() + cacheline - 1 ) & ~(uintptr_t)( cacheline - 1 ) );
+
+            for( uint32_t i = 0; i < threads; i++ )
+                new( &meters[i] ) meter();
+
+            for( uint32_t i = 0; i < threads; i++ )
+                workers.push_back( std::thread( &pool::work, this, i ) );
+        }
+
+        ~pool()
+        {
+            stop.store( true, std::memory_order_relaxed );
+
+            for( uint32_t i = 0; i < workers.size(); i++ )
+                workers[i].join();
+        }
+
+        // slots processed so far
+        uint64_t processed() const
+        {
+            uint64_t items = 0;
+
+            for( uint32_t i = 0; i < workers.size(); i++ )
+                items += meters[i].items.load( std::memory_order_relaxed );
+
+            return items;
+        }
+
+    private:
+        // a worker's count alone on its cache line, written by that worker only
+        struct meter
+        {
+            std::atomic<uint64_t> items;
+            uint8_t pad[cacheline - sizeof( std::atomic<uint64_t> )];
+
+            meter() : items( 0 )
+            {
+            }
+        };
+
+        void work( uint32_t t )
+        {
+            while( !stop.load( std::memory_order_relaxed ) )
+                if( round<0>( meters[t] ) == 0 )
+                    std::this_thread::yield();
+        }
+
+        template<size_t I>
+        typename std::enable_if<I < sizeof...( Nodes ), uint32_t>::type round( meter & m )
+        {
+            return serve( std::get<I>( nodes ), m ) + round<I + 1>( m );
+        }
+
+        template<size_t I>
+        typename std::enable_if<I == sizeof...( Nodes ), uint32_t>::type round( meter & )
+        {
+            return 0;
+        }
+
+        template<typename Queue>
+        static uint32_t push( Queue &, none &, uint32_t )
+        {
+            return 0;
+        }
+
+        template<typename Queue, typename Push>
+        static uint32_t push( Queue & q, Push & cb, uint32_t batch )
+        {
+            uint32_t n;
+
+            if( !q.push_enter() )
+                return 0;
+
+            n = q.push( batch, cb );
+            q.push_leave();
+
+            return n;
+        }
+
+        template<typename Queue>
+        static uint32_t pop( Queue &, none & )
+        {
+            return 0;
+        }
+
+        template<typename Queue, typename Pop>
+        static uint32_t pop( Queue & q, Pop & cb )
+        {
+            uint32_t n;
+
+            if( !q.pop_enter() )
+                return 0;
+
+            n = q.pop( Queue::size, cb );
+            q.pop_leave();
+
+            return n;
+        }
+
+        template<typename Node>
+        static uint32_t serve( Node & n, meter & m )
+        {
+            uint32_t work = push( n.q, n.push, n.batch );
+            uint32_t done = n.q.proc( n.batch, n.proc );
+
+            if( done )
+                m.items.store( m.items.load( std::memory_order_relaxed ) + done, std::memory_order_relaxed );
+
+            return work + done + pop( n.q, n.pop );
+        }
+
+        std::atomic<bool> stop;
+        std::unique_ptr<uint8_t[]> meters_mem;
+        meter * meters;
+        std::tuple<Nodes...> nodes;
+        std::vector<std::thread> workers;
+    };
+
+    template<typename... Nodes>
+    std::unique_ptr<pool<Nodes...>> make_pool( uint32_t threads, Nodes... ns )
+    {
+        return std::unique_ptr<pool<Nodes...>>( new pool<Nodes...>( threads, ns... ) );
+    }
+}
+
+#endif // SOQUE_HPP